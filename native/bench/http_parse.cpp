@@ -0,0 +1,97 @@
+/**
+ * Microbenchmark of the request parser: hap_http_parse() of a complete
+ * request followed by hap_network_flush(), as a controller sends them
+ *
+ * Built with network.cpp alone, the rest of the server is stubbed out
+ * below so that only parsing is measured. To compare with another
+ * revision of the parser, build this target against its network.cpp.
+ *
+ * Usage: bench_http_parse [iterations] (default 100000, best of 12 runs)
+ */
+#include "HomeKitAccessory.h"
+#include "network.h"
+#include "hap_pair_info.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const struct {
+    const char * name;
+    const char * data;
+} requests[] = {
+    { "GET /characteristics?id=...",
+      "GET /characteristics?id=1.10,1.11,2.10,2.11,3.10&meta=1&perms=1&type=1&ev=1 HTTP/1.1\r\n"
+      "Host: Bridge-1234._hap._tcp.local\r\n"
+      "Accept: */*\r\n"
+      "User-Agent: HomeKit/1 CFNetwork/1240.0.4 Darwin/20.6.0\r\n"
+      "Accept-Language: en-us\r\n"
+      "Accept-Encoding: gzip, deflate\r\n"
+      "\r\n" },
+
+    { "PUT /characteristics",
+      "PUT /characteristics HTTP/1.1\r\n"
+      "Host: Bridge-1234._hap._tcp.local\r\n"
+      "Content-Type: application/hap+json\r\n"
+      "Content-Length: 44\r\n"
+      "User-Agent: HomeKit/1 CFNetwork/1240.0.4 Darwin/20.6.0\r\n"
+      "\r\n"
+      "{\"characteristics\":[{\"aid\":1,\"iid\":10,\"v\":1}" },
+};
+
+//The server, never dispatching what the parser emits
+void HAPServer::emit(HAPEvent::EventID, void *, HAPEventListener::Callback){ }
+void HAPServer::onInboundData(hap_network_connection *, uint8_t *, uint8_t *, unsigned int){ }
+void HAPServer::onOutboundData(hap_network_connection *, uint8_t *, unsigned int){ }
+void HAPServer::preDeviceDisconnection(hap_network_connection *){ }
+
+hap_pair_info::hap_pair_info(HAPServer * server): server(server){ }
+hap_pair_info::~hap_pair_info(){ }
+bool hap_pair_info::paired(){ return false; }
+
+bool hap_network_send(hap_network_connection *, const uint8_t *, unsigned int){ return true; }
+void hap_network_close(hap_network_connection *){ }
+void hap_network_release(hap_network_connection *){ }
+
+static double now(){
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char ** argv){
+    auto iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+    //Only the address is used by the stubs
+    alignas(HAPServer) static uint8_t serverStorage[sizeof(HAPServer)];
+    hap_network_connection server {};
+    server.server = reinterpret_cast<HAPServer *>(serverStorage);
+    hap_network_connection client {};
+    hap_event_network_accept(&server, &client);
+
+    for(auto& request : requests){
+        auto data = reinterpret_cast<const uint8_t *>(request.data);
+        auto length = static_cast<unsigned int>(strlen(request.data));
+
+        //Parsed in full, or the numbers are meaningless
+        hap_http_parse(&client, data, length);
+        auto header = &client.user->request_header;
+        if(client.user->parse_state != HTTP_PARSE_COMPLETE || header->path == PATH_UNKNOWN){
+            fprintf(stderr, "%s: not parsed\n", request.name);
+            return 1;
+        }
+        hap_network_flush(&client);
+
+        double best = 0;
+        for(int run = 0; run < 12; ++run){
+            auto start = now();
+            for(int i = 0; i < iterations; ++i){
+                hap_http_parse(&client, data, length);
+                hap_network_flush(&client);
+            }
+            auto elapsed = (now() - start) / iterations;
+            if(run == 0 || elapsed < best) best = elapsed;
+        }
+        printf("%-28s %3u bytes: %7.1f ns/request\n", request.name, length, best);
+    }
+    return 0;
+}
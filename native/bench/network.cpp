@@ -0,0 +1,164 @@
+/**
+ * Echo benchmark of the socket backend, built once per backend
+ *
+ * The server runs hap_network_loop() on its own thread and echoes
+ * everything back. For each number of connections, the client measures
+ *  - latency: round trips on a single connection while the others stay idle
+ *  - throughput: one message on every connection, then all the replies
+ *
+ * Usage: bench_network_<backend> [connections...] (default 16 256 4096)
+ */
+#include "common.h"
+#include "network.h"
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#ifndef HAP_BENCH_BACKEND
+#define HAP_BENCH_BACKEND "unknown"
+#endif
+
+#define HAP_BENCH_PORT 50180
+#define HAP_BENCH_MESSAGE 64
+
+static std::atomic<bool> serverReady { false };
+static std::atomic<bool> serverRunning { true };
+static hap_network_connection server {};
+
+void hap_event_network_accept(hap_network_connection *, hap_network_connection * client){ client->user = nullptr; }
+
+void hap_event_network_receive(hap_network_connection * client, const uint8_t * data, unsigned int length){
+    hap_network_send(client, data, length);
+}
+
+void hap_event_network_receivev(hap_network_connection * client, const hap_network_iovec * iov, unsigned int count){
+    hap_network_sendv(client, iov, count);
+}
+
+void hap_event_network_close(hap_network_connection * client){ hap_network_release(client); }
+
+void hap_event_network_congestion(hap_network_connection *, bool){ }
+
+bool hap_network_verified(hap_network_connection *){ return true; }
+
+static void serve(){
+    if(!hap_network_init_bind(&server, HAP_BENCH_PORT)){
+        fprintf(stderr, "bind failed\n");
+        exit(1);
+    }
+    serverReady = true;
+    while (serverRunning){
+        hap_network_loop(-1);
+        hap_network_send_pending();
+    }
+}
+
+static double now(){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool readFully(int fd, uint8_t * buffer, size_t length){
+    while (length > 0){
+        auto n = read(fd, buffer, length);
+        if(n <= 0) return false;
+        buffer += n;
+        length -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static int connectServer(){
+    auto fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(HAP_BENCH_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0){
+        perror("connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void run(unsigned int connections){
+    std::vector<int> clients;
+    for(unsigned int i = 0; i < connections; ++i) clients.push_back(connectServer());
+
+    uint8_t message[HAP_BENCH_MESSAGE];
+    uint8_t reply[HAP_BENCH_MESSAGE];
+    memset(message, 'x', sizeof(message));
+
+    //Warm up every connection so they are all accepted and registered
+    for(auto fd : clients) if(write(fd, message, sizeof(message)) != sizeof(message)) exit(1);
+    for(auto fd : clients) if(!readFully(fd, reply, sizeof(reply))) exit(1);
+
+    const unsigned int roundTrips = 20000;
+    auto start = now();
+    for(unsigned int i = 0; i < roundTrips; ++i){
+        auto fd = clients[0];
+        if(write(fd, message, sizeof(message)) != sizeof(message) || !readFully(fd, reply, sizeof(reply))) exit(1);
+    }
+    auto latency = (now() - start) / roundTrips * 1e6;
+
+    unsigned int rounds = 200000 / connections;
+    if(rounds < 20) rounds = 20;
+    start = now();
+    for(unsigned int i = 0; i < rounds; ++i){
+        for(auto fd : clients) if(write(fd, message, sizeof(message)) != sizeof(message)) exit(1);
+        for(auto fd : clients) if(!readFully(fd, reply, sizeof(reply))) exit(1);
+    }
+    auto elapsed = now() - start;
+    auto throughput = rounds * static_cast<double>(connections) / elapsed;
+
+    printf("%-8s %6u connections: %8.2f us round trip, %10.0f messages/s\n",
+           HAP_BENCH_BACKEND, connections, latency, throughput);
+
+    for(auto fd : clients) close(fd);
+    //Let the server see the connections go before the next run
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+}
+
+int main(int argc, char ** argv){
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<unsigned int> counts;
+    for(int i = 1; i < argc; ++i) counts.push_back(static_cast<unsigned int>(atoi(argv[i])));
+    if(counts.empty()) counts = { 16, 256, 4096 };
+
+    //Both ends of every connection live in this process
+    rlimit limit {};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    std::thread serverThread(serve);
+    while (!serverReady) std::this_thread::yield();
+
+    for(auto count : counts){
+        if(count * 2 + 16 > limit.rlim_cur){
+            printf("%-8s %6u connections: skipped, RLIMIT_NOFILE is %lu\n",
+                   HAP_BENCH_BACKEND, count, static_cast<unsigned long>(limit.rlim_cur));
+            continue;
+        }
+        run(count);
+    }
+
+    serverRunning = false;
+    hap_network_wakeup(&server);
+    serverThread.join();
+    return 0;
+}
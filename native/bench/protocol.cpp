@@ -0,0 +1,105 @@
+/**
+ * Benchmark of the HTTP layer of HAPServer over the loopback backend
+ *
+ * Client and server run on this thread: every request is parsed, routed
+ * and answered by HAPServer as it would be over a socket, without the
+ * kernel or any scheduling in the numbers. Each case reports the best of
+ * 5 runs, in nanoseconds per request:
+ *  - round trip: one request at a time on a single connection
+ *  - pipelined: batches of 16 requests written at once
+ *  - connections: one request on each of 64 connections, then the replies
+ *
+ * Usage: bench_protocol [requests] (default 20000 per run)
+ */
+#include "http_client.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#define HAP_BENCH_PORT 5020
+
+static HAPServer server;
+
+static const std::string request =
+        "GET /echo?id=1.10 HTTP/1.1\r\n"
+        "Host: Bridge-1234._hap._tcp.local\r\n"
+        "User-Agent: HomeKit/1 CFNetwork/1240.0.4 Darwin/20.6.0\r\n"
+        "\r\n";
+
+static void echo(HAPUserHelper * request, void *){
+    request->setContentType(HAP_JSON);
+    request->send("{}");
+}
+
+static double now(){
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void check(bool answered){
+    if(answered) return;
+    fprintf(stderr, "request not answered\n");
+    exit(1);
+}
+
+static double roundTrip(unsigned int requests){
+    HAPTestClient client(server, HAP_BENCH_PORT);
+    HAPTestResponse response;
+    auto start = now();
+    for(unsigned int i = 0; i < requests; ++i){
+        client.write(request);
+        check(client.read(response) && response.status == 200);
+    }
+    return (now() - start) / requests;
+}
+
+static double pipelined(unsigned int requests){
+    const unsigned int batch = 16;
+    std::string batched;
+    for(unsigned int i = 0; i < batch; ++i) batched += request;
+
+    HAPTestClient client(server, HAP_BENCH_PORT);
+    HAPTestResponse response;
+    auto start = now();
+    for(unsigned int i = 0; i < requests; i += batch){
+        client.write(batched);
+        for(unsigned int j = 0; j < batch; ++j) check(client.read(response) && response.status == 200);
+    }
+    return (now() - start) / requests;
+}
+
+static double connections(unsigned int requests){
+    std::vector<std::unique_ptr<HAPTestClient>> clients;
+    for(unsigned int i = 0; i < 64; ++i) clients.emplace_back(new HAPTestClient(server, HAP_BENCH_PORT));
+
+    HAPTestResponse response;
+    auto start = now();
+    for(unsigned int i = 0; i < requests; i += 64){
+        for(auto& client : clients) client->write(request);
+        for(auto& client : clients) check(client->read(response) && response.status == 200);
+    }
+    return (now() - start) / requests;
+}
+
+static void run(const char * name, double (*bench)(unsigned int), unsigned int requests){
+    double best = 0;
+    for(int run = 0; run < 5; ++run){
+        auto elapsed = bench(requests);
+        if(run == 0 || elapsed < best) best = elapsed;
+    }
+    printf("%-12s %8.0f ns/request\n", name, best);
+}
+
+int main(int argc, char ** argv){
+    auto requests = argc > 1 ? static_cast<unsigned int>(atoi(argv[1])) : 20000u;
+
+    server.begin(HAP_BENCH_PORT);
+    server.route(GET, "/echo", echo, nullptr, false);
+
+    run("round trip", roundTrip, requests);
+    run("pipelined", pipelined, requests);
+    run("connections", connections, requests);
+    return 0;
+}
@@ -0,0 +1,120 @@
+/**
+ * HTTP client over the loopback backend, for the tests and benchmarks
+ * linked against hapd_loopback
+ *
+ * Everything runs on the calling thread: reading a response turns the
+ * server's loop until the response is complete, so there is no timing
+ * involved and the results are the same on every run.
+ */
+#ifndef HAPD_NATIVE_HTTP_CLIENT_H
+#define HAPD_NATIVE_HTTP_CLIENT_H
+
+#include "HomeKitAccessory.h"
+#include "platform/loopback_network.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <strings.h>
+
+struct HAPTestResponse {
+    int status = 0;
+    std::string head;
+    std::string body;
+
+    //Value of a response header, empty if it is missing
+    std::string header(const char * name) const {
+        auto nameLength = strlen(name);
+        for(size_t line = head.find("\r\n"); line != std::string::npos; line = head.find("\r\n", line + 2)){
+            auto start = line + 2;
+            if(head.size() < start + nameLength + 2 || head[start + nameLength] != ':') continue;
+            if(strncasecmp(head.c_str() + start, name, nameLength) != 0) continue;
+            auto end = head.find("\r\n", start);
+            return head.substr(start + nameLength + 2, end == std::string::npos ? std::string::npos : end - start - nameLength - 2);
+        }
+        return std::string();
+    }
+};
+
+class HAPTestClient {
+public:
+    HAPTestClient(HAPServer & server, uint16_t port): server(server) {
+        client = hap_loopback_connect(port);
+        //Accepted by the next turn
+        server.runOnce(0);
+    }
+
+    ~HAPTestClient(){
+        if(client) hap_loopback_disconnect(client);
+        server.runOnce(0);
+    }
+
+    bool write(const std::string & data){
+        return client && hap_loopback_write(client, reinterpret_cast<const uint8_t *>(data.data()),
+                                            static_cast<unsigned int>(data.size()));
+    }
+
+    /**
+     * Turn the loop until a whole response arrived
+     *
+     * @param turns Turns of the loop to give up after
+     * @return false if none arrived
+     */
+    bool read(HAPTestResponse & response, unsigned int turns = 64){
+        for(unsigned int turn = 0; !_take(response); ++turn){
+            if(turn == turns) return false;
+            server.runOnce(0);
+            _receive();
+        }
+        return true;
+    }
+
+    /**
+     * Turn the loop and tell whether the server sent anything more
+     */
+    bool idle(unsigned int turns = 8){
+        for(unsigned int turn = 0; turn < turns; ++turn){
+            server.runOnce(0);
+            _receive();
+        }
+        return received.empty();
+    }
+
+    bool connected(){
+        return client && hap_loopback_connected(client);
+    }
+
+    //Everything received and not taken as a response yet
+    std::string received;
+
+private:
+    void _receive(){
+        uint8_t buf[4096];
+        while (auto n = hap_loopback_read(client, buf, sizeof(buf))) received.append(reinterpret_cast<char *>(buf), n);
+    }
+
+    bool _take(HAPTestResponse & response){
+        auto headEnd = received.find("\r\n\r\n");
+        if(headEnd == std::string::npos) return false;
+
+        HAPTestResponse parsed;
+        parsed.head = received.substr(0, headEnd);
+        auto space = parsed.head.find(' ');
+        if(space == std::string::npos) return false;
+        parsed.status = atoi(parsed.head.c_str() + space + 1);
+
+        auto length = parsed.header("Content-Length");
+        size_t bodyLength = length.empty() ? 0 : static_cast<size_t>(atol(length.c_str()));
+        if(received.size() < headEnd + 4 + bodyLength) return false;
+
+        parsed.body = received.substr(headEnd + 4, bodyLength);
+        received.erase(0, headEnd + 4 + bodyLength);
+        response = parsed;
+        return true;
+    }
+
+    HAPServer & server;
+    hap_loopback_client * client = nullptr;
+};
+
+#endif //HAPD_NATIVE_HTTP_CLIENT_H
@@ -0,0 +1,133 @@
+/**
+ * Stand-in for the raw TCP API of lwip, enough to run the lwip backend
+ * on the host. A pcb records what the backend does to it, and the test
+ * plays lwip by calling the callbacks the backend registered.
+ */
+#pragma once
+
+//Included within extern "C" like the real header
+extern "C++" {
+
+#include <cstdint>
+#include <vector>
+
+typedef int8_t err_t;
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_CONN -11
+#define ERR_ABRT -13
+
+#define TCP_WRITE_FLAG_COPY 0x01
+#define TCP_WRITE_FLAG_MORE 0x02
+#define TCP_SND_QUEUELEN 8
+#define SOF_KEEPALIVE 0x08
+#define LWIP_TCP_KEEPALIVE 1
+#define IP_ADDR_ANY nullptr
+
+struct pbuf {
+    pbuf * next;
+    void * payload;
+    u16_t len;
+    u16_t tot_len;
+};
+
+struct tcp_pcb;
+typedef err_t (*tcp_accept_fn)(void *, tcp_pcb *, err_t);
+typedef err_t (*tcp_recv_fn)(void *, tcp_pcb *, pbuf *, err_t);
+typedef err_t (*tcp_sent_fn)(void *, tcp_pcb *, u16_t);
+typedef err_t (*tcp_poll_fn)(void *, tcp_pcb *);
+typedef void (*tcp_err_fn)(void *, err_t);
+
+struct tcp_pcb {
+    u32_t remote_ip = 0;
+    u16_t remote_port = 0;
+    u8_t so_options = 0;
+    u32_t keep_idle = 0, keep_intvl = 0, keep_cnt = 0;
+
+    void * arg = nullptr;
+    tcp_accept_fn accept = nullptr;
+    tcp_recv_fn recv = nullptr;
+    tcp_sent_fn sent = nullptr;
+    tcp_poll_fn poll = nullptr;
+    tcp_err_fn err = nullptr;
+
+    //Send window and segments, given back by mock_ack()
+    unsigned int sndbuf = 2920;
+    unsigned int queuelen = 0;
+    unsigned int inflight = 0;
+
+    //Everything written, and the flags of each tcp_write()
+    std::vector<uint8_t> wire;
+    std::vector<u8_t> flags;
+    unsigned int outputs = 0;
+    unsigned int recved = 0;
+
+    //tcp_close() fails with ERR_MEM, as when lwip is out of memory
+    bool closeFails = false;
+    bool closed = false;
+    bool aborted = false;
+};
+
+//Number of pbuf_free() calls, lwip leaks the chain when it isn't freed
+extern unsigned int mock_pbuf_freed;
+
+//The last pcb from tcp_new(), the listening one after hap_network_init_bind()
+extern tcp_pcb * mock_created_pcb;
+
+#define tcp_sndbuf(pcb) (static_cast<u16_t>((pcb)->sndbuf))
+#define tcp_sndqueuelen(pcb) ((pcb)->queuelen)
+
+inline err_t tcp_write(tcp_pcb * pcb, const void * data, u16_t length, u8_t flags){
+    if(length > pcb->sndbuf || pcb->queuelen >= TCP_SND_QUEUELEN) return ERR_MEM;
+    auto bytes = static_cast<const uint8_t *>(data);
+    pcb->wire.insert(pcb->wire.end(), bytes, bytes + length);
+    pcb->flags.push_back(flags);
+    pcb->sndbuf -= length;
+    pcb->inflight += length;
+    ++pcb->queuelen;
+    return ERR_OK;
+}
+
+inline err_t tcp_output(tcp_pcb * pcb){ ++pcb->outputs; return ERR_OK; }
+inline void tcp_recved(tcp_pcb * pcb, u16_t length){ pcb->recved += length; }
+inline u8_t pbuf_free(pbuf *){ ++mock_pbuf_freed; return 1; }
+
+inline void tcp_arg(tcp_pcb * pcb, void * arg){ pcb->arg = arg; }
+inline void tcp_accept(tcp_pcb * pcb, tcp_accept_fn fn){ pcb->accept = fn; }
+inline void tcp_recv(tcp_pcb * pcb, tcp_recv_fn fn){ pcb->recv = fn; }
+inline void tcp_sent(tcp_pcb * pcb, tcp_sent_fn fn){ pcb->sent = fn; }
+inline void tcp_err(tcp_pcb * pcb, tcp_err_fn fn){ pcb->err = fn; }
+inline void tcp_poll(tcp_pcb * pcb, tcp_poll_fn fn, u8_t){ pcb->poll = fn; }
+
+inline err_t tcp_close(tcp_pcb * pcb){
+    if(pcb->closeFails) return ERR_MEM;
+    pcb->closed = true;
+    return ERR_OK;
+}
+
+inline void tcp_abort(tcp_pcb * pcb){ pcb->aborted = true; }
+inline void tcp_accepted(tcp_pcb *){ }
+inline void tcp_nagle_disable(tcp_pcb *){ }
+inline void tcp_nagle_enable(tcp_pcb *){ }
+
+inline tcp_pcb * tcp_new(){ return mock_created_pcb = new tcp_pcb(); }
+inline err_t tcp_bind(tcp_pcb *, const void *, u16_t){ return ERR_OK; }
+inline tcp_pcb * tcp_listen(tcp_pcb * pcb){ return pcb; }
+
+/**
+ * The client acknowledges everything in flight, which frees the window
+ * and the segments, then lwip calls the sent callback
+ */
+inline err_t mock_ack(tcp_pcb * pcb){
+    auto acked = pcb->inflight;
+    pcb->inflight = 0;
+    pcb->sndbuf += acked;
+    pcb->queuelen = 0;
+    return pcb->sent ? pcb->sent(pcb->arg, pcb, static_cast<u16_t>(acked)) : ERR_OK;
+}
+
+}
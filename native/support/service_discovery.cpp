@@ -0,0 +1,14 @@
+#include "common.h"
+#include "network.h"
+
+//Native builds without dns_sd.h have nothing to advertise with, the
+//loopback backend already brings its own stubs
+#if !defined(USE_APPLE_DNS_SD) && !defined(USE_HAP_LOOPBACK)
+void * hap_service_discovery_init(const char *, uint16_t){ return nullptr; }
+
+bool hap_service_discovery_update(void *, hap_sd_txt_item *){ return false; }
+
+void hap_service_discovery_loop(void *){ }
+
+void hap_service_discovery_deinit(void *){ }
+#endif
@@ -0,0 +1,96 @@
+/**
+ * Reads deferred by HAP_NETWORK_READ_BUDGET when the socket backend is
+ * driven by a foreign event loop through hap_network_pollfds()
+ *
+ * Built with a small budget, the message below takes several turns. The
+ * host must not stall between them: hap_network_timeout() has to return 0
+ * while reads are left, and hap_network_process() has to serve them
+ * whatever woke the host up.
+ */
+#include "common.h"
+#include "network.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+#define HAP_TEST_PORT 50181
+#define HAP_TEST_MESSAGE (HAP_NETWORK_READ_BUDGET * 4)
+
+static int failures = 0;
+
+#define EXPECT(cond) do { if(!(cond)){ fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while (0)
+
+static unsigned int received = 0;
+
+void hap_event_network_accept(hap_network_connection *, hap_network_connection * client){ client->user = nullptr; }
+
+void hap_event_network_receive(hap_network_connection *, const uint8_t *, unsigned int length){ received += length; }
+
+void hap_event_network_receivev(hap_network_connection *, const hap_network_iovec * iov, unsigned int count){
+    for(unsigned int i = 0; i < count; ++i) received += iov[i].length;
+}
+
+void hap_event_network_close(hap_network_connection * client){ hap_network_release(client); }
+
+void hap_event_network_congestion(hap_network_connection *, bool){ }
+
+bool hap_network_verified(hap_network_connection *){ return true; }
+
+int main(){
+    signal(SIGPIPE, SIG_IGN);
+
+    hap_network_connection server {};
+    EXPECT(hap_network_init_bind(&server, HAP_TEST_PORT));
+
+    auto fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(HAP_TEST_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    EXPECT(connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0);
+
+    static uint8_t message[HAP_TEST_MESSAGE];
+    memset(message, 'x', sizeof(message));
+    EXPECT(write(fd, message, sizeof(message)) == sizeof(message));
+    //Everything is buffered on the server side before the first turn
+    usleep(50000);
+
+    //The host loop, waits that time out while the message is incomplete are stalls
+    unsigned int stalls = 0, turns = 0, deferredTurns = 0;
+    while (received < HAP_TEST_MESSAGE && turns < 100){
+        ++turns;
+        hap_network_pollfd fds[16];
+        auto count = hap_network_pollfds(fds, 16);
+        pollfd pfds[16];
+        for(unsigned int i = 0; i < count && i < 16; ++i) pfds[i] = { fds[i].fd, fds[i].events, 0 };
+
+        auto timeout = hap_network_timeout(-1);
+        if(timeout == 0) ++deferredTurns;
+        if(timeout < 0 || timeout > 100) timeout = 100;
+
+        auto ready = poll(pfds, count, timeout);
+        if(ready == 0){
+            if(timeout > 0 && received > 0) ++stalls;
+            hap_network_process(-1, 0);
+            continue;
+        }
+        for(unsigned int i = 0; i < count; ++i){
+            if(pfds[i].revents) hap_network_process(pfds[i].fd, pfds[i].revents);
+        }
+    }
+
+    EXPECT(received == HAP_TEST_MESSAGE);
+    EXPECT(stalls == 0);
+    //The budget split the message
+    EXPECT(deferredTurns > 0);
+
+    close(fd);
+    if(failures == 0) printf("deferred_reads: ok (%u turns)\n", turns);
+    return failures == 0 ? 0 : 1;
+}
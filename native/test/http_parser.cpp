@@ -0,0 +1,126 @@
+/**
+ * The request parser, through HAPServer over the loopback backend: each
+ * request of the table is answered with what the parser made of it, or
+ * must close the connection.
+ */
+//Includes HomeKitAccessory.h, which has no include guard
+#include "http_client.h"
+
+#include <cstdio>
+
+static int failures = 0;
+
+#define EXPECT(cond) do { if(!(cond)){ printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+#define HAP_TEST_PORT 5011
+
+static HAPServer server;
+
+/**
+ * Answers with "METHOD path id=... MPTE type body": the query parameters
+ * meta, perms, type and ev as 0 or 1, then the content type
+ */
+static void describe(HAPUserHelper * request, void *){
+    static const char * methods[] = { "?", "GET", "PUT", "POST" };
+    static const char * types[] = { "-", "tlv8", "json" };
+    auto params = request->params();
+    std::string body = methods[request->method()];
+    body += " ";
+    body += request->pathName();
+    body += " id=";
+    if(params->id) body += params->id;
+    body += " ";
+    body += params->meta ? '1' : '0';
+    body += params->perms ? '1' : '0';
+    body += params->type ? '1' : '0';
+    body += params->ev ? '1' : '0';
+    body += " ";
+    body += types[request->requestContentType()];
+    body += " ";
+    if(request->dataLength()) body.append(reinterpret_cast<const char *>(request->data()), request->dataLength());
+    request->send(body.data(), static_cast<unsigned int>(body.size()));
+}
+
+static const struct {
+    const char * name;
+    const char * request;
+    //0 when the connection must be closed instead
+    int status;
+    const char * body;
+} cases[] = {
+    { "plain get", "GET /echo HTTP/1.1\r\nHost: hapd\r\n\r\n", 200, "GET /echo id= 0000 - " },
+    { "all parameters", "GET /echo?id=1.10,2.11&meta=1&perms=1&type=1&ev=1 HTTP/1.1\r\n\r\n",
+      200, "GET /echo id=1.10,2.11 1111 - " },
+    { "parameter values", "GET /echo?ev=true&meta=0&perms=false&type=t HTTP/1.1\r\n\r\n", 200, "GET /echo id= 0011 - " },
+    { "parameter names in any case", "GET /echo?ID=1.1&Ev=1 HTTP/1.1\r\n\r\n", 200, "GET /echo id=1.1 0001 - " },
+    { "unknown and empty parameters", "GET /echo?foo=bar&ev&perms=1& HTTP/1.1\r\n\r\n", 200, "GET /echo id= 0100 - " },
+    { "body", "PUT /echo HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello", 200, "PUT /echo id= 0000 - hello" },
+    { "header names in any case", "PUT /echo HTTP/1.1\r\ncontent-LENGTH: 3\r\n\r\nabc", 200, "PUT /echo id= 0000 - abc" },
+    { "blanks around values", "PUT /echo HTTP/1.1\r\nContent-Length: \t 3 \t\r\n\r\nabc", 200, "PUT /echo id= 0000 - abc" },
+    { "json", "PUT /echo HTTP/1.1\r\nContent-Type: application/hap+json\r\n\r\n", 200, "PUT /echo id= 0000 json " },
+    { "tlv8 with parameters", "POST /echo HTTP/1.1\r\nContent-Type: Application/Pairing+TLV8; charset=utf-8\r\n\r\n",
+      200, "POST /echo id= 0000 tlv8 " },
+    { "unknown content type", "PUT /echo HTTP/1.1\r\nContent-Type: text/plain\r\n\r\n", 200, "PUT /echo id= 0000 - " },
+    { "bare line feeds", "GET /echo HTTP/1.1\nHost: hapd\n\n", 200, "GET /echo id= 0000 - " },
+    { "empty lines before the request", "\r\n\r\nGET /echo HTTP/1.1\r\n\r\n", 200, "GET /echo id= 0000 - " },
+    { "unknown method", "DELETE /echo HTTP/1.1\r\n\r\n", 404, nullptr },
+    { "unknown path", "GET /echo/ HTTP/1.1\r\n\r\n", 404, nullptr },
+
+    { "request line without target", "GARBAGE\r\n\r\n", 0, nullptr },
+    { "request line without version", "GET /echo\r\n\r\n", 0, nullptr },
+    { "header without colon", "GET /echo HTTP/1.1\r\nHost hapd\r\n\r\n", 0, nullptr },
+    { "empty content length", "PUT /echo HTTP/1.1\r\nContent-Length:\r\n\r\n", 0, nullptr },
+    { "content length not a number", "PUT /echo HTTP/1.1\r\nContent-Length: 1x\r\n\r\n", 0, nullptr },
+    { "negative content length", "PUT /echo HTTP/1.1\r\nContent-Length: -1\r\n\r\n", 0, nullptr },
+    { "body too large", "PUT /echo HTTP/1.1\r\nContent-Length: 16385\r\n\r\n", 0, nullptr },
+};
+
+/**
+ * Send the request on a connection of its own and check the answer
+ */
+static void check(const char * name, const std::string & request, int status, const char * body){
+    HAPTestClient client(server, HAP_TEST_PORT);
+    EXPECT(client.write(request));
+
+    if(status == 0){
+        //Closed without an answer
+        if(!client.idle() || client.connected()) printf("%s: not closed\n", name);
+        EXPECT(client.received.empty());
+        EXPECT(!client.connected());
+        return;
+    }
+
+    HAPTestResponse response;
+    if(!client.read(response)){
+        printf("%s: no response\n", name);
+        ++failures;
+        return;
+    }
+    if(response.status != status || (body && response.body != body))
+        printf("%s: %d \"%s\"\n", name, response.status, response.body.c_str());
+    EXPECT(response.status == status);
+    EXPECT(body == nullptr || response.body == body);
+    EXPECT(client.idle());
+    EXPECT(client.connected());
+}
+
+int main(){
+    server.begin(HAP_TEST_PORT);
+    EXPECT(server.route(GET, "/echo", describe, nullptr, false));
+    EXPECT(server.route(PUT, "/echo", describe, nullptr, false));
+    EXPECT(server.route(POST, "/echo", describe, nullptr, false));
+
+    for(auto& test : cases) check(test.name, test.request, test.status, test.body);
+
+    //Largest body and header accepted, then one byte more
+    check("largest body", "PUT /echo HTTP/1.1\r\nContent-Length: 16384\r\n\r\n" + std::string(16384, 'x'),
+          200, nullptr);
+    std::string head = "GET /echo HTTP/1.1\r\nX-Padding: ";
+    head += std::string(HAP_HTTP_MAX_HEADER - head.size() - 4, 'x') + "\r\n\r\n";
+    check("largest header", head, 200, "GET /echo id= 0000 - ");
+    head.insert(head.size() - 4, "x");
+    check("header too large", head, 0, nullptr);
+
+    if(failures == 0) printf("http_parser: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+/**
+ * Requests end to end through HAPServer over the loopback backend
+ */
+//Includes HomeKitAccessory.h, which has no include guard
+#include "http_client.h"
+
+#include <cstdio>
+
+static int failures = 0;
+
+#define EXPECT(cond) do { if(!(cond)){ printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+#define HAP_TEST_PORT 5010
+
+static HAPServer server;
+
+/**
+ * Answers with the method, the path and the body of the request
+ */
+static void echo(HAPUserHelper * request, void *){
+    static const char * methods[] = { "?", "GET", "PUT", "POST" };
+    std::string body = methods[request->method()];
+    body += " ";
+    body += request->pathName();
+    body += " ";
+    if(request->dataLength()) body.append(reinterpret_cast<const char *>(request->data()), request->dataLength());
+    request->send(body.data(), static_cast<unsigned int>(body.size()));
+}
+
+static void pipelined(){
+    HAPTestClient client(server, HAP_TEST_PORT);
+    EXPECT(client.write("GET /echo HTTP/1.1\r\n\r\nGET /echo HTTP/1.1\r\n\r\nPOST /echo HTTP/1.1\r\n\r\n"));
+
+    HAPTestResponse response;
+    EXPECT(client.read(response) && response.status == 200 && response.body == "GET /echo ");
+    EXPECT(client.read(response) && response.status == 200 && response.body == "GET /echo ");
+    EXPECT(client.read(response) && response.status == 200 && response.body == "POST /echo ");
+    EXPECT(client.idle());
+}
+
+static void split(){
+    HAPTestClient client(server, HAP_TEST_PORT);
+    std::string request = "PUT /echo HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello";
+    for(size_t i = 0; i < request.size(); ++i){
+        EXPECT(client.write(request.substr(i, 1)));
+        //Nothing is answered before the last byte
+        if(i + 1 < request.size()) EXPECT(client.idle(1));
+    }
+
+    HAPTestResponse response;
+    EXPECT(client.read(response) && response.status == 200 && response.body == "PUT /echo hello");
+    EXPECT(client.idle());
+}
+
+static void body_then_pipelined(){
+    HAPTestClient client(server, HAP_TEST_PORT);
+    EXPECT(client.write("POST /echo HTTP/1.1\r\nContent-Length: 3\r\n\r\nabcGET /echo HTTP/1.1\r\n\r\n"));
+
+    HAPTestResponse response;
+    EXPECT(client.read(response) && response.status == 200 && response.body == "POST /echo abc");
+    //The body of the first request doesn't leak into the second
+    EXPECT(client.read(response) && response.status == 200 && response.body == "GET /echo ");
+    EXPECT(client.idle());
+}
+
+static void not_found(){
+    HAPTestClient client(server, HAP_TEST_PORT);
+    EXPECT(client.write("GET /missing HTTP/1.1\r\n\r\nGET /echo HTTP/1.1\r\n\r\n"));
+
+    HAPTestResponse response;
+    EXPECT(client.read(response) && response.status == 404);
+    //The connection keeps serving
+    EXPECT(client.read(response) && response.status == 200 && response.body == "GET /echo ");
+    EXPECT(client.connected());
+}
+
+struct TestCharacteristic : public BaseCharacteristic {
+    explicit TestCharacteristic(HAPServer * server): BaseCharacteristic(1, server, 0x25) {
+        format = FORMAT_UINT8;
+        permissions = CPERM_PR | CPERM_EV;
+        value.uint8_value = 0;
+    }
+
+    void set(uint8_t v){
+        CharacteristicValue update;
+        update.uint8_value = v;
+        setValue(update);
+    }
+};
+
+static TestCharacteristic * characteristic = nullptr;
+
+static void subscribe(HAPUserHelper * request, void *){
+    server.subscribe(request, characteristic);
+    request->send(HTTP_204_NO_CONTENT);
+}
+
+static void large(HAPUserHelper * request, void *){
+    std::string body(HAP_NETWORK_OUTPUT_HIGH_WATERMARK, 'x');
+    request->send(body.data(), static_cast<unsigned int>(body.size()));
+}
+
+/**
+ * A subscriber that doesn't read gets the latest value once it catches up,
+ * instead of every update or none
+ */
+static void congested_subscriber(){
+    TestCharacteristic c(&server);
+    characteristic = &c;
+    HAPTestClient client(server, HAP_TEST_PORT);
+    HAPTestResponse response;
+    EXPECT(client.write("GET /subscribe HTTP/1.1\r\n\r\n"));
+    EXPECT(client.read(response) && response.status == 204);
+
+    c.set(1);
+    EXPECT(client.read(response) && response.head.compare(0, 9, "EVENT/1.0") == 0);
+    EXPECT(response.body.find("\"value\":1") != std::string::npos);
+
+    //Congested by a response that isn't read
+    EXPECT(client.write("GET /large HTTP/1.1\r\n\r\n"));
+    for(int turn = 0; turn < 4; ++turn) server.runOnce(0);
+    c.set(2);
+    c.set(3);
+    for(int turn = 0; turn < 4; ++turn) server.runOnce(0);
+
+    EXPECT(client.read(response) && response.status == 200);
+    EXPECT(client.read(response) && response.head.compare(0, 9, "EVENT/1.0") == 0);
+    EXPECT(response.body.find("\"value\":3") != std::string::npos);
+    EXPECT(client.idle());
+    characteristic = nullptr;
+}
+
+static std::string dispatched;
+
+static void onVerify(hap_pair_info *){ dispatched += "v"; }
+static void onDisconnect(hap_network_connection *){ dispatched += "d"; }
+
+/**
+ * The connection is freed by HAP_NET_DISCONNECT, which must wait for the
+ * events of the lower lanes that were queued before it
+ */
+static void disconnect_order(){
+    hap_pair_info info(&server);
+    auto verify = server.on<HAPEvent::HAP_DEVICE_VERIFY, &onVerify>();
+    auto disconnect = server.on<HAPEvent::HAP_NET_DISCONNECT, &onDisconnect>();
+
+    {
+        HAPTestClient client(server, HAP_TEST_PORT);
+        for(int i = 0; i < 16; ++i) server.emit<HAPEvent::HAP_DEVICE_VERIFY>(&info);
+    }
+    for(int turn = 0; turn < 8; ++turn) server.runOnce(0);
+    EXPECT(dispatched == std::string(16, 'v') + "d");
+
+    server.off(verify);
+    server.off(disconnect);
+}
+
+int main(){
+    server.begin(HAP_TEST_PORT);
+    EXPECT(server.route(GET, "/echo", echo, nullptr, false));
+    EXPECT(server.route(PUT, "/echo", echo, nullptr, false));
+    EXPECT(server.route(POST, "/echo", echo, nullptr, false));
+    EXPECT(server.route(GET, "/subscribe", subscribe, nullptr, false));
+    EXPECT(server.route(GET, "/large", large, nullptr, false));
+
+    pipelined();
+    split();
+    body_then_pipelined();
+    not_found();
+    disconnect_order();
+    congested_subscriber();
+
+    if(failures == 0) printf("loopback: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+/**
+ * The lwip backend under HAPServer, on the lwip stand-in of
+ * support/lwip: the test plays lwip by calling the callbacks
+ * registered on the pcbs.
+ */
+#include "HomeKitAccessory.h"
+#include "network.h"
+
+#include <lwip/tcp.h>
+#include <cstdio>
+#include <cstring>
+
+unsigned int mock_pbuf_freed = 0;
+tcp_pcb * mock_created_pcb = nullptr;
+
+static int failures = 0;
+
+#define EXPECT(cond) do { if(!(cond)){ printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+static tcp_pcb * listening = nullptr;
+
+static tcp_pcb * accept(){
+    auto pcb = new tcp_pcb();
+    EXPECT(listening->accept(listening->arg, pcb, ERR_OK) == ERR_OK);
+    EXPECT(pcb->recv != nullptr);
+    return pcb;
+}
+
+/**
+ * Hand the strings to the receive callback as one pbuf chain
+ */
+static err_t receive(tcp_pcb * pcb, const char * const * segments, unsigned int count){
+    pbuf chain[8];
+    u16_t total = 0;
+    for(auto i = count; i-- > 0;){
+        auto length = static_cast<u16_t>(strlen(segments[i]));
+        total += length;
+        chain[i] = { i + 1 < count ? &chain[i + 1] : nullptr, const_cast<char *>(segments[i]), length, total };
+    }
+    return pcb->recv(pcb->arg, pcb, &chain[0], ERR_OK);
+}
+
+static void scattered(){
+    auto pcb = accept();
+    const char * request[] = { "GET /acc", "essories HTTP/1.1\r\n", "Host: hapd\r\n", "\r\n" };
+    auto freed = mock_pbuf_freed;
+    EXPECT(receive(pcb, request, 4) == ERR_OK);
+    EXPECT(mock_pbuf_freed == freed + 1);
+    EXPECT(pcb->recved == strlen("GET /accessories HTTP/1.1\r\nHost: hapd\r\n\r\n"));
+
+    //Answered by the loop
+    HKAccessory.handle();
+    EXPECT(!pcb->wire.empty());
+    EXPECT(!pcb->closed);
+
+    //Closed by the client
+    EXPECT(pcb->recv(pcb->arg, pcb, nullptr, ERR_OK) == ERR_OK);
+    EXPECT(pcb->closed);
+    HKAccessory.handle();
+    delete pcb;
+}
+
+static void closed_by_handler(){
+    auto pcb = accept();
+
+    //The first segment is rejected and closes the connection, the others
+    //must not reach the freed connection
+    const char * request[] = { "BAD\r\n", "GET / HTTP/1.1\r\n", "\r\n" };
+    auto freed = mock_pbuf_freed;
+    EXPECT(receive(pcb, request, 3) == ERR_OK);
+    EXPECT(mock_pbuf_freed == freed + 1);
+    EXPECT(pcb->closed);
+    EXPECT(!pcb->aborted);
+    //lwip doesn't call back for a closed pcb
+    EXPECT(pcb->recv == nullptr && pcb->arg == nullptr);
+
+    HKAccessory.handle();
+    delete pcb;
+}
+
+static void aborted_by_handler(){
+    auto pcb = accept();
+    //Out of memory, the pcb is aborted instead
+    pcb->closeFails = true;
+
+    const char * request[] = { "BAD\r\n", "\r\n" };
+    auto freed = mock_pbuf_freed;
+    EXPECT(receive(pcb, request, 2) == ERR_ABRT);
+    EXPECT(mock_pbuf_freed == freed + 1);
+    EXPECT(pcb->aborted);
+
+    HKAccessory.handle();
+    delete pcb;
+}
+
+static void error(){
+    auto pcb = accept();
+    //The pcb is already freed by lwip when the error callback runs
+    pcb->err(pcb->arg, ERR_CONN);
+    HKAccessory.handle();
+    delete pcb;
+}
+
+int main(){
+    HKAccessory.begin(5001);
+    listening = mock_created_pcb;
+    EXPECT(listening != nullptr && listening->accept != nullptr);
+    if(failures) return 1;
+
+    scattered();
+    closed_by_handler();
+    aborted_by_handler();
+    error();
+
+    if(failures == 0) printf("lwip_network: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,172 @@
+/**
+ * Pipelined and split requests through HAPServer over the loopback
+ * backend: requests are answered once each and in order, however the
+ * bytes arrive.
+ */
+//Includes HomeKitAccessory.h, which has no include guard
+#include "http_client.h"
+
+#include <cstdio>
+
+static int failures = 0;
+
+#define EXPECT(cond) do { if(!(cond)){ printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+#define HAP_TEST_PORT 5012
+
+static HAPServer server;
+
+/**
+ * Answers with the method, the path and the body of the request
+ */
+static void echo(HAPUserHelper * request, void *){
+    static const char * methods[] = { "?", "GET", "PUT", "POST" };
+    std::string body = methods[request->method()];
+    body += " ";
+    body += request->pathName();
+    body += " ";
+    if(request->dataLength()) body.append(reinterpret_cast<const char *>(request->data()), request->dataLength());
+    request->send(body.data(), static_cast<unsigned int>(body.size()));
+}
+
+//Request kept by hold() until the test answers it
+static HAPUserHelper * held = nullptr;
+
+static void hold(HAPUserHelper * request, void *){
+    request->retain();
+    held = request;
+}
+
+static void answerHeld(){
+    held->send("held");
+    held->release();
+    held = nullptr;
+}
+
+static std::string put(const std::string & body){
+    return "PUT /echo HTTP/1.1\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+static void many(){
+    HAPTestClient client(server, HAP_TEST_PORT);
+    std::string requests;
+    for(int i = 0; i < 32; ++i) requests += put(std::to_string(i));
+    EXPECT(client.write(requests));
+
+    HAPTestResponse response;
+    for(int i = 0; i < 32; ++i)
+        EXPECT(client.read(response) && response.status == 200 && response.body == "PUT /echo " + std::to_string(i));
+    EXPECT(client.idle());
+    EXPECT(client.connected());
+}
+
+/**
+ * Two pipelined requests written in two pieces, for every place the
+ * bytes can be split at
+ */
+static void split_anywhere(){
+    auto requests = put("first") + "GET /echo?id=1.1 HTTP/1.1\r\nHost: hapd\r\n\r\n";
+    for(size_t at = 1; at < requests.size(); ++at){
+        HAPTestClient client(server, HAP_TEST_PORT);
+        EXPECT(client.write(requests.substr(0, at)));
+        EXPECT(client.write(requests.substr(at)));
+
+        HAPTestResponse response;
+        bool answered = client.read(response) && response.body == "PUT /echo first" &&
+                        client.read(response) && response.body == "GET /echo " && client.idle();
+        if(!answered) printf("split at %zu\n", at);
+        EXPECT(answered);
+    }
+}
+
+/**
+ * The same requests one byte per write, each byte in its own turn
+ */
+static void byte_by_byte(){
+    HAPTestClient client(server, HAP_TEST_PORT);
+    auto requests = put("first") + put("") + "POST /echo HTTP/1.1\r\n\r\n";
+    for(auto c : requests){
+        EXPECT(client.write(std::string(1, c)));
+        client.idle(1);
+    }
+
+    HAPTestResponse response;
+    EXPECT(client.read(response) && response.body == "PUT /echo first");
+    EXPECT(client.read(response) && response.body == "PUT /echo ");
+    EXPECT(client.read(response) && response.body == "POST /echo ");
+    EXPECT(client.idle());
+}
+
+/**
+ * Requests behind one that isn't answered yet wait for it
+ */
+static void behind_held(){
+    HAPTestClient client(server, HAP_TEST_PORT);
+    EXPECT(client.write("GET /hold HTTP/1.1\r\n\r\n" + put("second")));
+    EXPECT(client.idle());
+    EXPECT(held != nullptr);
+
+    //More of the pipeline arrives in the meantime
+    EXPECT(client.write(put("third")));
+    EXPECT(client.idle());
+
+    answerHeld();
+    HAPTestResponse response;
+    EXPECT(client.read(response) && response.body == "held");
+    EXPECT(client.read(response) && response.body == "PUT /echo second");
+    EXPECT(client.read(response) && response.body == "PUT /echo third");
+    EXPECT(client.idle());
+    EXPECT(client.connected());
+}
+
+/**
+ * More than HAP_HTTP_MAX_PIPELINE bytes behind a request closes the
+ * connection, up to that is kept
+ */
+static void pipeline_limit(){
+    //A request and empty lines, which are skipped
+    std::string body(HAP_HTTP_MAX_PIPELINE - 64, 'x');
+    auto fill = put(body);
+    fill.append(HAP_HTTP_MAX_PIPELINE - fill.size(), '\n');
+
+    {
+        HAPTestClient client(server, HAP_TEST_PORT);
+        EXPECT(client.write("GET /hold HTTP/1.1\r\n\r\n"));
+        EXPECT(client.idle());
+        EXPECT(client.write(fill));
+        EXPECT(client.idle());
+        EXPECT(client.connected());
+
+        answerHeld();
+        HAPTestResponse response;
+        EXPECT(client.read(response) && response.body == "held");
+        EXPECT(client.read(response) && response.body == "PUT /echo " + body);
+        EXPECT(client.idle());
+    }
+
+    HAPTestClient client(server, HAP_TEST_PORT);
+    EXPECT(client.write("GET /hold HTTP/1.1\r\n\r\n"));
+    EXPECT(client.idle());
+    EXPECT(client.write(fill + "\n"));
+    EXPECT(client.idle());
+    EXPECT(!client.connected());
+    //Left behind with its connection, which is gone
+    held = nullptr;
+}
+
+int main(){
+    server.begin(HAP_TEST_PORT);
+    EXPECT(server.route(GET, "/echo", echo, nullptr, false));
+    EXPECT(server.route(PUT, "/echo", echo, nullptr, false));
+    EXPECT(server.route(POST, "/echo", echo, nullptr, false));
+    EXPECT(server.route(GET, "/hold", hold, nullptr, false));
+
+    many();
+    split_anywhere();
+    byte_by_byte();
+    behind_held();
+    pipeline_limit();
+
+    if(failures == 0) printf("pipelining: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+/**
+ * HAPServer::route() and the answers to routed and unrouted paths, over
+ * the loopback backend
+ */
+//Includes HomeKitAccessory.h, which has no include guard
+#include "http_client.h"
+
+#include <cstdio>
+
+static int failures = 0;
+
+#define EXPECT(cond) do { if(!(cond)){ printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+#define HAP_TEST_PORT 5013
+
+static HAPServer server;
+
+/**
+ * Answers with the string given to route(), then the id parameter
+ */
+static void named(HAPUserHelper * request, void * argument){
+    std::string body = static_cast<const char *>(argument);
+    if(request->params()->id){
+        body += " ";
+        body += request->params()->id;
+    }
+    request->send(body.data(), static_cast<unsigned int>(body.size()));
+}
+
+/**
+ * Send a request on a connection of its own
+ *
+ * @return The status of the answer, 0 if there is none
+ */
+static int statusOf(const char * method, const char * target, std::string * body = nullptr){
+    HAPTestClient client(server, HAP_TEST_PORT);
+    client.write(std::string(method) + " " + target + " HTTP/1.1\r\n\r\n");
+    HAPTestResponse response;
+    if(!client.read(response)) return 0;
+    if(body) *body = response.body;
+    return response.status;
+}
+
+static void registration(){
+    //Answered by hapd itself
+    EXPECT(!server.route(GET, "/accessories", named, nullptr, false));
+    EXPECT(!server.route(PUT, "/characteristics", named, nullptr, false));
+    EXPECT(!server.route(POST, "/pair-setup", named, nullptr, false));
+    EXPECT(!server.route(POST, "/Pair-Verify", named, nullptr, false));
+    EXPECT(!server.route(POST, "/pairings", named, nullptr, false));
+
+    EXPECT(!server.route(METHOD_UNKNOWN, "/a", named, nullptr, false));
+    EXPECT(!server.route(GET, nullptr, named, nullptr, false));
+    EXPECT(!server.route(GET, "/a", nullptr, nullptr, false));
+
+    EXPECT(server.route(GET, "/a", named, const_cast<char *>("get a"), false));
+    EXPECT(server.route(PUT, "/a", named, const_cast<char *>("put a"), false));
+    EXPECT(server.route(GET, "/A", named, const_cast<char *>("get A"), false));
+    EXPECT(server.route(POST, "/identify", named, const_cast<char *>("identify"), false));
+    EXPECT(server.route(GET, "/locked", named, const_cast<char *>("locked"), true));
+    //Already routed for the method
+    EXPECT(!server.route(GET, "/a", named, nullptr, false));
+
+    //Half of the slots can be used
+    EXPECT(server.route(GET, "/b", named, const_cast<char *>("get b"), false));
+    EXPECT(server.route(GET, "/c", named, const_cast<char *>("get c"), false));
+    EXPECT(server.route(GET, "/d", named, const_cast<char *>("get d"), false));
+    EXPECT(!server.route(GET, "/e", named, nullptr, false));
+}
+
+static const struct {
+    const char * method;
+    const char * target;
+    int status;
+    //nullptr when no body is expected
+    const char * body;
+} cases[] = {
+    { "GET", "/a", 200, "get a" },
+    { "PUT", "/a", 200, "put a" },
+    { "GET", "/a?id=1.10", 200, "get a 1.10" },
+    //Case sensitive, although the hashes are the same
+    { "GET", "/A", 200, "get A" },
+    { "PUT", "/A", 404, nullptr },
+    { "POST", "/identify", 200, "identify" },
+    { "GET", "/b", 200, "get b" },
+    { "GET", "/c", 200, "get c" },
+    { "GET", "/d", 200, "get d" },
+
+    { "POST", "/a", 404, nullptr },
+    { "GET", "/a/", 404, nullptr },
+    { "GET", "/e", 404, nullptr },
+    { "GET", "/identify", 404, nullptr },
+    { "DELETE", "/a", 404, nullptr },
+
+    //The controller hasn't completed pair verify
+    { "GET", "/locked", 470, nullptr },
+    { "GET", "/locked?id=1.10", 470, nullptr },
+};
+
+int main(){
+    server.begin(HAP_TEST_PORT);
+    registration();
+
+    for(auto& test : cases){
+        std::string body;
+        auto status = statusOf(test.method, test.target, &body);
+        if(status != test.status || (test.body && body != test.body))
+            printf("%s %s: %d \"%s\"\n", test.method, test.target, status, body.c_str());
+        EXPECT(status == test.status);
+        EXPECT(test.body == nullptr || body == test.body);
+    }
+
+    if(failures == 0) printf("routes: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+#include "HAPTimerWheel.h"
+#include <cstdio>
+
+static int failures = 0;
+
+#define EXPECT(cond) do { if(!(cond)){ printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+static void count(void * argument){ ++*static_cast<int *>(argument); }
+
+static void interval(){
+    HAPTimerWheel wheel;
+    int fired = 0;
+    wheel.add(0, 1000, 1000, count, &fired);
+
+    for(uint32_t now = 0; now <= 10000; now += 10) wheel.advance(now);
+    EXPECT(fired == 10);
+}
+
+static void stalled(){
+    HAPTimerWheel wheel;
+    int fired = 0;
+    wheel.add(0, 1000, 1000, count, &fired);
+
+    //The loop is blocked for 11s, the missed runs are skipped
+    wheel.advance(11500);
+    EXPECT(fired == 1);
+
+    //And it keeps its phase afterwards
+    EXPECT(wheel.nextTimeout(11500) <= 500);
+    wheel.advance(11999);
+    EXPECT(fired == 1);
+    wheel.advance(12000);
+    EXPECT(fired == 2);
+}
+
+static void stalled_wrap(){
+    HAPTimerWheel wheel;
+    int fired = 0;
+    uint32_t start = 0xffffffffu - 2500;
+    wheel.add(start, 100, 100, count, &fired);
+
+    wheel.advance(start + 5050);
+    EXPECT(fired == 1);
+    wheel.advance(start + 5099);
+    EXPECT(fired == 1);
+    wheel.advance(start + 5100);
+    EXPECT(fired == 2);
+}
+
+static void one_shot(){
+    HAPTimerWheel wheel;
+    int fired = 0;
+    wheel.add(0, 300, 0, count, &fired);
+    auto cancelled = wheel.add(0, 200, 0, count, &fired);
+    EXPECT(wheel.cancel(cancelled));
+    EXPECT(!wheel.cancel(cancelled));
+
+    wheel.advance(299);
+    EXPECT(fired == 0);
+    wheel.advance(5000);
+    EXPECT(fired == 1);
+    EXPECT(wheel.count() == 0);
+    EXPECT(wheel.nextTimeout(5000) == -1);
+}
+
+int main(){
+    interval();
+    stalled();
+    stalled_wrap();
+    one_shot();
+    return failures ? 1 : 0;
+}
@@ -27,7 +27,7 @@
 
 static void _freeHelper(HAPEvent * event){
     auto c = event->arg<BaseCharacteristic>();
-    c->lastOperator->release();
+    if(c->lastOperator) c->lastOperator->release();
     c->lastOperator = nullptr;
 }
 
@@ -37,8 +37,21 @@ BaseCharacteristic::BaseCharacteristic(unsigned int parentAccessory, HAPServer *
 }
 
 void BaseCharacteristic::setValue(CharacteristicValue v, HAPUserHelper * sender) {
+    _updateValue(v, sender);
+#ifdef USE_HAP_SHARDS
+    server->_replicateValue(this);
+#endif
+}
+
+void BaseCharacteristic::_updateValue(CharacteristicValue v, HAPUserHelper * sender) {
     lastOperator = sender;
     value = v;
     if(sender) sender->retain();
-    server->emit(HAPEvent::HAP_CHARACTERISTIC_UPDATE, this, &_freeHelper);
+    server->emit<HAPEvent::HAP_CHARACTERISTIC_UPDATE>(this, &_freeHelper);
+}
+
+void BaseCharacteristic::postValue(CharacteristicValue v) {
+    //Freed by HAPServer::_onCharPosted() on the loop thread
+    auto update = new HAPPostedValue { this, v, false };
+    server->post<HAPEvent::HAP_CHARACTERISTIC_POSTED_VALUE>(update);
 }
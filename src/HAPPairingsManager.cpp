@@ -42,7 +42,7 @@ HAPPairingsManager::HAPPairingsManager(HAPServer * server): server(server) {
 
     //If no accessory keypair, then init one
     if(!server->storage->haveAccessoryLongTermKeys()){
-        server->emit(HAPEvent::HAP_INITIALIZE_KEYPAIR);
+        server->emit<HAPEvent::HAP_INITIALIZE_KEYPAIR>();
     }
 }
 
@@ -212,7 +212,7 @@ void HAPPairingsManager::onPairingDeviceDecryption(hap_pair_info * info, HAPUser
         if(hap_crypto_longterm_verify(signature, iOSDeviceInfo, IOS_DEVICE_INFO_LEN, deviceLtpk)){
             delete[] signature;
             delete[] iOSDeviceInfo;
-            server->emit(HAPEvent::HAP_DEVICE_PAIR, info);
+            server->emit<HAPEvent::HAP_DEVICE_PAIR>(info);
             return;
         }
 
@@ -491,7 +491,7 @@ void HAPPairingsManager::onVerifyingDeviceDecryption(hap_pair_info * info, HAPUs
                 delete[] signature;
                 tlv8_free(subtlv);
                 memcpy(info->identifier, ident, IOS_PAIRING_ID_LEN);
-                server->emit(HAPEvent::HAP_DEVICE_VERIFY, info);
+                server->emit<HAPEvent::HAP_DEVICE_VERIFY>(info);
                 return;
             }
         }
@@ -548,16 +548,16 @@ hap_crypto_info *hap_pair_info::prepare(bool isWrite, hap_network_connection * c
     auto crypto = new hap_crypto_info(server, nullptr);
     crypto->reset();
     memcpy(crypto->key, isWrite ? AccessoryToControllerKey : ControllerToAccessoryKey, 32);
-    memset(nonceStore, 0, 8);
     auto cnt = isWrite ? writeCount : readCount;
-    for(auto& n : nonceStore){
+    for(auto& n : crypto->frameNonce){
         n = static_cast<uint8_t>(cnt % 0xff);
         cnt /= 0xff;
     }
     (*(isWrite ? &writeCount : &readCount))++;
-    crypto->nonce = nonceStore;
+    crypto->nonce = crypto->frameNonce;
     crypto->nonceLen = 8;
     crypto->conn = conn;
+    crypto->connId = conn->id;
     crypto->flags |= CRYPTO_FLAG_NETWORK;
     return crypto;
 }
@@ -51,6 +51,13 @@
 
 #define FLAG_CRYPTO_KEYS    0b00000001
 
+//The servers of a shard group share the storage, see HAPServer::addShard()
+#ifdef USE_HAP_SHARDS
+#define STORAGE_LOCK std::lock_guard<std::recursive_mutex> lock(mutex)
+#else
+#define STORAGE_LOCK
+#endif
+
 HAPPersistingStorage::HAPPersistingStorage() {
     handle = hap_persistence_init();
     flags = new PersistFlags();
@@ -69,6 +76,7 @@ HAPPersistingStorage::~HAPPersistingStorage() {
 }
 
 void HAPPersistingStorage::format() {
+    STORAGE_LOCK;
     HAP_DEBUG("Formatting persist storage...");
 
     hap_persistence_format(handle);
@@ -79,10 +87,12 @@ void HAPPersistingStorage::format() {
 }
 
 bool HAPPersistingStorage::haveAccessoryLongTermKeys() {
+    STORAGE_LOCK;
     return ((flags->cryptography) & FLAG_CRYPTO_KEYS) == FLAG_CRYPTO_KEYS; // NOLINT
 }
 
 void HAPPersistingStorage::setAccessoryLongTermKeys(const uint8_t *publicKey, const uint8_t *privateKey) {
+    STORAGE_LOCK;
     auto ret = hap_persistence_write(handle, FIXED_LTPK_ADDR, publicKey, FIXED_LTPK_LEN);
     ret &= hap_persistence_write(handle, FIXED_LTSK_ADDR, privateKey, FIXED_LTSK_LEN);
 
@@ -99,15 +109,18 @@ void HAPPersistingStorage::writeFlags() {
 }
 
 void HAPPersistingStorage::getAccessoryLongTermKeys(uint8_t *publicKey, uint8_t *privateKey) {
+    STORAGE_LOCK;
     hap_persistence_read(handle, FIXED_LTPK_ADDR, publicKey, FIXED_LTPK_LEN);
     hap_persistence_read(handle, FIXED_LTSK_ADDR, privateKey, FIXED_LTSK_LEN);
 }
 
 void HAPPersistingStorage::getAccessoryLTPK(uint8_t *publicKey) {
+    STORAGE_LOCK;
     hap_persistence_read(handle, FIXED_LTPK_ADDR, publicKey, FIXED_LTPK_LEN);
 }
 
 void HAPPersistingStorage::addPairedDevice(const uint8_t *identifier, const uint8_t *publicKey, const PersistFlags *flags) {
+    STORAGE_LOCK;
     auto previousCount = pairedDevicesCount();
     auto device = PairedDevice();
 
@@ -133,6 +146,7 @@ void HAPPersistingStorage::addPairedDevice(const uint8_t *identifier, const uint
 }
 
 unsigned int HAPPersistingStorage::pairedDevicesCount() {
+    STORAGE_LOCK;
     uint8_t buf[FIXED_OBJCNT_LEN];
     unsigned int cnt = 0;
     hap_persistence_read(handle, FIXED_OBJCNT_ADDR, buf, FIXED_OBJCNT_LEN);
@@ -146,6 +160,7 @@ unsigned int HAPPersistingStorage::pairedDevicesCount() {
 }
 
 void HAPPersistingStorage::setPairedDeviceCount(unsigned int cnt) {
+    STORAGE_LOCK;
     uint8_t buf[FIXED_OBJCNT_LEN];
     for(auto i = FIXED_OBJCNT_LEN - 1; i >= 0; --i){
         buf[i] = static_cast<uint8_t>(cnt % 0xff);
@@ -155,6 +170,7 @@ void HAPPersistingStorage::setPairedDeviceCount(unsigned int cnt) {
 }
 
 PairedDevice * HAPPersistingStorage::retrievePairedDevice(const uint8_t *identifier) {
+    STORAGE_LOCK;
     int i = pairedDevicesCount();
     uint8_t idBuf[DYNAM_PAIR_ID_LEN];
     while (--i >= 0){
@@ -175,6 +191,7 @@ PairedDevice * HAPPersistingStorage::retrievePairedDevice(const uint8_t *identif
 }
 
 bool HAPPersistingStorage::removePairedDevice(const uint8_t *identifier) {
+    STORAGE_LOCK;
     auto origCnt = pairedDevicesCount();
     auto cnt = origCnt;
     uint8_t idBuf[DYNAM_PAIR_ID_LEN];
@@ -28,6 +28,10 @@
 
 #include "common.h"
 
+#ifdef USE_HAP_SHARDS
+#include <mutex>
+#endif
+
 /**
  * The 4bytes flags
  */
@@ -135,6 +139,9 @@ public:
 private:
     void * handle;
     PersistFlags * flags;
+#ifdef USE_HAP_SHARDS
+    std::recursive_mutex mutex;
+#endif
 
     void writeFlags();
 };
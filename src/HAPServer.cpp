@@ -26,6 +26,7 @@
 #include "HomeKitAccessory.h"
 #include "network.h"
 #include "hap_crypto.h"
+#include "async_math.h"
 #include "HAPPersistingStorage.h"
 
 #include <cstring>
@@ -34,26 +35,21 @@ HAPServer HKAccessory;
 
 void HAPServer::begin(uint16_t port) {
     _clearEventListeners();
+    //Drop what a previous run left, but not the mailbox: values posted before
+    //begin(), e.g. by the other servers of a shard group, are still delivered
     _clearEventQueue();
     _clearSubscribers();
-
-    //Register all events handled internally by HAPServer
-    _onSelf(HAPEvent::HAP_NET_RECEIVE_REQUEST, &HAPServer::_onRequestReceived);
-
-    _onSelf(HAPEvent::HAP_CHARACTERISTIC_UPDATE, &HAPServer::_onCharUpdate);
-
-    _onSelf(HAPEvent::HAPCRYPTO_DECRYPTED, &HAPServer::_onDataDecrypted);
-    _onSelf(HAPEvent::HAPCRYPTO_ENCRYPTED, &HAPServer::_onDataEncrypted);
-    _onSelf(HAPEvent::HAP_INITIALIZE_KEYPAIR, &HAPServer::_onInitKeypairReq);
-
-    //For HAPPairingsManager
-    _onSelf(HAPEvent::HAPCRYPTO_SRP_INIT_COMPLETE, &HAPServer::_onSetupInitComplete);
-    _onSelf(HAPEvent::HAPCRYPTO_SRP_PROOF_COMPLETE, &HAPServer::_onSetupProofComplete);
-    _onSelf(HAPEvent::HAP_DEVICE_PAIR, &HAPServer::_onDevicePair);
-    _onSelf(HAPEvent::HAP_DEVICE_VERIFY, &HAPServer::_onDeviceVerify);
-
-    delete storage;
-    storage = new HAPPersistingStorage();
+    _fillEventPool(HAP_EVENT_POOL_SIZE);
+
+#ifdef USE_HAP_SHARDS
+    if(primary){
+        storage = primary->storage;
+    } else
+#endif
+    {
+        delete storage;
+        storage = new HAPPersistingStorage();
+    }
 
     delete pairingsManager;
     pairingsManager = new HAPPairingsManager(this);
@@ -62,31 +58,277 @@ void HAPServer::begin(uint16_t port) {
     server_conn->raw = nullptr;
     server_conn->user = nullptr;
     server_conn->server = this;
+    server_conn->id = 0;
 
     hap_network_init_bind(server_conn, port);
+#ifdef USE_ATOMIC_MAILBOX
+    //post() and stop() may already be called from other threads
+    wakeTarget.store(server_conn, std::memory_order_release);
+#endif
+
+#ifdef USE_HAP_SHARDS
+    //The group is advertised once, by the primary
+    if(primary) return;
+#endif
     mdns_handle = hap_service_discovery_init(deviceName, port);
     _updateSDRecords();
 }
 
-void HAPServer::handle() {
-    //networks
-    hap_network_loop();
-    hap_service_discovery_loop(mdns_handle);
-
-    //handle events
-    auto currentEvent = _dequeueEvent();
-    if(currentEvent){
-        auto currentListener = eventListeners;
-        while (currentListener != nullptr){
-            if(currentListener->listening == currentEvent->name){
-                if(currentListener->onEvent) currentListener->onEvent(currentEvent);
-                if(currentListener->_internalOnEvent) (this->*(currentListener->_internalOnEvent))(currentEvent);
-            }
-            currentListener = currentListener->next;
+#ifdef USE_HAP_SHARDS
+void HAPServer::addShard(HAPServer * shard) {
+    auto last = this;
+    while (last->nextShard != nullptr) last = last->nextShard;
+    last->nextShard = shard;
+    shard->primary = this;
+}
+
+/**
+ * Post a new value to the same characteristic on the other servers of the group
+ *
+ * The accessory database isn't modified once the servers run, so it is
+ * safe to look the characteristic up from this thread.
+ */
+void HAPServer::_replicateValue(BaseCharacteristic * c) {
+    for(auto shard = primary ? primary : this; shard != nullptr; shard = shard->nextShard){
+        if(shard == this) continue;
+
+        auto accessory = shard->accessories;
+        while (accessory != nullptr && accessory->accessoryIdentifier != c->accessoryIdentifier){
+            accessory = accessory->next;
         }
-        if(currentEvent->didEmit) currentEvent->didEmit(currentEvent);
-        delete currentEvent;
+        auto replica = accessory ? accessory->getCharacteristic(c->instanceIdentifier) : nullptr;
+        if(replica == nullptr) continue;
+
+        shard->post<HAPEvent::HAP_CHARACTERISTIC_POSTED_VALUE>(new HAPPostedValue { replica, c->value, true });
+    }
+}
+#endif
+
+void HAPServer::handle() {
+    runOnce(0);
+}
+
+void HAPServer::run() {
+    loopRunning = true;
+    while (loopRunning) runOnce(-1);
+}
+
+void HAPServer::runOnce(int timeout) {
+    //networks, only block if there is nothing to dispatch
+    hap_network_loop(_nextTimeout(timeout));
+
+    _processIteration();
+}
+
+unsigned int HAPServer::getPollDescriptors(hap_network_pollfd * fds, unsigned int max) {
+    return hap_network_pollfds(fds, max);
+}
+
+int HAPServer::getPollTimeout() {
+    //The network may have work of its own, like reads left for the next turn
+    return _nextTimeout(hap_network_timeout(-1));
+}
+
+void HAPServer::processReady(int fd, short events) {
+    hap_network_process(fd, events);
+    _processIteration();
+}
+
+void HAPServer::processPending() {
+    hap_network_process(-1, 0);
+    _processIteration();
+}
+
+void HAPServer::_processIteration() {
+#ifdef USE_EVENT_LOOP_STATS
+    auto iterationStart = hap_micros();
+#endif
+    if(mdns_handle) hap_service_discovery_loop(mdns_handle);
+
+    _collectMailbox();
+    timers.advance(hap_millis());
+    _drainEvents();
+
+    //Everything the handlers sent in this iteration goes out together
+    hap_network_send_pending();
+
+#ifdef USE_EVENT_LOOP_STATS
+    auto iteration = hap_micros_since(iterationStart);
+    if(iteration > loopStats.longestIteration) loopStats.longestIteration = iteration;
+#endif
+}
+
+void HAPServer::stop() {
+    loopRunning = false;
+    _wakeup();
+}
+
+int HAPServer::_nextTimeout(int timeout) {
+    if(_hasQueuedEvents()) return 0;
+#ifdef USE_ATOMIC_MAILBOX
+    if(mailbox.load(std::memory_order_acquire) != nullptr) return 0;
+#endif
+
+    //Wake up in time for the next timer
+    auto timerTimeout = timers.nextTimeout(hap_millis());
+    if(timerTimeout >= 0 && (timeout < 0 || timerTimeout < timeout)) return timerTimeout;
+    return timeout;
+}
+
+HAPTimerID HAPServer::setTimeout(unsigned int ms, HAPTimerCallback cb, void * argument) {
+    return timers.add(hap_millis(), ms, 0, cb, argument);
+}
+
+HAPTimerID HAPServer::setInterval(unsigned int ms, HAPTimerCallback cb, void * argument) {
+    //A zero interval would fire on every tick
+    if(ms == 0) ms = 1;
+    return timers.add(hap_millis(), ms, ms, cb, argument);
+}
+
+bool HAPServer::clearTimer(HAPTimerID id) {
+    return timers.cancel(id);
+}
+
+void HAPServer::_drainEvents() {
+    //handle events until the queue is drained or the budget runs out
+    auto start = hap_millis();
+    unsigned int dispatched = 0;
+    while (auto currentEvent = _dequeueEvent()){
+        _dispatchEvent(currentEvent);
+        ++dispatched;
+
+        if(loopEventBudget && dispatched >= loopEventBudget) break;
+        if(loopTimeBudget && (hap_millis() - start) >= loopTimeBudget) break;
+    }
+}
+
+void HAPServer::setLoopBudget(unsigned int maxEvents, unsigned int maxMillis) {
+    loopEventBudget = maxEvents;
+    loopTimeBudget = maxMillis;
+}
+
+#ifdef USE_EVENT_LOOP_STATS
+static void _recordHistogram(unsigned long * histogram, uint32_t micros){
+    unsigned int bucket = 0;
+    while (micros > 1 && bucket < HAPEventLoopStats::HISTOGRAM_BUCKETS - 1){
+        micros >>= 1;
+        ++bucket;
+    }
+    ++histogram[bucket];
+}
+#endif
+
+/**
+ * Events handled by HAPServer itself are bound here rather than through
+ * listeners, so each stage of the pipeline is a direct call.
+ */
+inline void HAPServer::_dispatchInternal(HAPEvent * event) {
+    switch (event->name){
+        case HAPEvent::HAP_NET_RECEIVE_REQUEST:
+            _onRequestReceived(hap_event_payload<HAPEvent::HAP_NET_RECEIVE_REQUEST>(event));
+            break;
+        case HAPEvent::HAP_CHARACTERISTIC_UPDATE:
+            _onCharUpdate(hap_event_payload<HAPEvent::HAP_CHARACTERISTIC_UPDATE>(event));
+            break;
+        case HAPEvent::HAP_NET_DRAINED:
+            _onConnectionDrained(hap_event_payload<HAPEvent::HAP_NET_DRAINED>(event));
+            break;
+        case HAPEvent::HAP_CHARACTERISTIC_POSTED_VALUE:
+            _onCharPosted(hap_event_payload<HAPEvent::HAP_CHARACTERISTIC_POSTED_VALUE>(event));
+            break;
+        case HAPEvent::HAPCRYPTO_DECRYPTED:
+            _onDataDecrypted(hap_event_payload<HAPEvent::HAPCRYPTO_DECRYPTED>(event));
+            break;
+        case HAPEvent::HAPCRYPTO_ENCRYPTED:
+            _onDataEncrypted(hap_event_payload<HAPEvent::HAPCRYPTO_ENCRYPTED>(event));
+            break;
+        case HAPEvent::HAP_INITIALIZE_KEYPAIR:
+            _onInitKeypairReq();
+            break;
+
+        //For HAPPairingsManager
+        case HAPEvent::HAPCRYPTO_SRP_INIT_COMPLETE:
+            _onSetupInitComplete(hap_event_payload<HAPEvent::HAPCRYPTO_SRP_INIT_COMPLETE>(event));
+            break;
+        case HAPEvent::HAPCRYPTO_SRP_PROOF_COMPLETE:
+            _onSetupProofComplete(hap_event_payload<HAPEvent::HAPCRYPTO_SRP_PROOF_COMPLETE>(event));
+            break;
+        case HAPEvent::HAP_DEVICE_PAIR:
+            _onDevicePair(hap_event_payload<HAPEvent::HAP_DEVICE_PAIR>(event));
+            break;
+        case HAPEvent::HAP_DEVICE_VERIFY:
+            _onDeviceVerify(hap_event_payload<HAPEvent::HAP_DEVICE_VERIFY>(event));
+            break;
+
+        //Steps of the async crypto functions
+        case HAPEvent::HAPCRYPTO_SRP_INIT_FINISH_GEN_SALT:
+            _srpInit_onGenSalt_thenGenPub(hap_event_payload<HAPEvent::HAPCRYPTO_SRP_INIT_FINISH_GEN_SALT>(event));
+            break;
+        case HAPEvent::HAPCRYPTO_SRP_PROOF_VERIFIER_CREATED:
+            _srpProof_onVerifierCreate_thenGenSKey(hap_event_payload<HAPEvent::HAPCRYPTO_SRP_PROOF_VERIFIER_CREATED>(event));
+            break;
+        case HAPEvent::HAPCRYPTO_SRP_PROOF_SKEY_GENERATED:
+            _srpProof_onSKey_thenM(hap_event_payload<HAPEvent::HAPCRYPTO_SRP_PROOF_SKEY_GENERATED>(event));
+            break;
+        case HAPEvent::HAPCRYPTO_SRP_PROOF_SSIDE_GENERATED:
+            _srpProof_onM_thenAMK(hap_event_payload<HAPEvent::HAPCRYPTO_SRP_PROOF_SSIDE_GENERATED>(event));
+            break;
+        case HAPEvent::HAPCRYPTO_NEED_DECRYPT:
+            _chachaPoly_decrypt(hap_event_payload<HAPEvent::HAPCRYPTO_NEED_DECRYPT>(event));
+            break;
+        case HAPEvent::HAPCRYPTO_NEED_ENCRYPT:
+            _chachaPoly_encrypt(hap_event_payload<HAPEvent::HAPCRYPTO_NEED_ENCRYPT>(event));
+            break;
+#ifdef USE_ASYNC_MATH
+        case HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_BODY:
+            _async_math_expmod_body(hap_event_payload<HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_BODY>(event));
+            break;
+        case HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_FINAL:
+            _async_math_expmod_final(hap_event_payload<HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_FINAL>(event));
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+void HAPServer::_dispatchEvent(HAPEvent * currentEvent) {
+#ifdef USE_EVENT_LOOP_STATS
+    auto dispatchStart = hap_micros();
+    //Both are hap_micros() timestamps, the difference is wrap safe
+    _recordHistogram(loopStats.dispatchLatency, static_cast<uint32_t>(dispatchStart - currentEvent->emittedAt));
+    ++loopStats.dispatched[currentEvent->name];
+#endif
+
+    //Internal handlers run first, then the listeners of this event
+    _dispatchInternal(currentEvent);
+    dispatchingEvent = currentEvent->name;
+    auto currentListener = eventListeners[currentEvent->name];
+    while (currentListener != nullptr){
+        if(currentListener->onEvent) currentListener->onEvent(currentEvent);
+        currentListener = currentListener->next;
+    }
+    dispatchingEvent = HAPEvent::EVENT_COUNT;
+    if(hasDetachedListeners) _sweepDetachedListeners(currentEvent->name);
+
+    if(currentEvent->didEmit) currentEvent->didEmit(currentEvent);
+    _releaseEvent(currentEvent);
+
+#ifdef USE_EVENT_LOOP_STATS
+    _recordHistogram(loopStats.handlerTime, hap_micros_since(dispatchStart));
+#endif
+}
+
+void HAPServer::_sweepDetachedListeners(HAPEvent::EventID id) {
+    auto rm = &eventListeners[id];
+    while (*rm != nullptr){
+        auto current = *rm;
+        if(current->detached){
+            *rm = current->next;
+            _releaseListener(current);
+        } else rm = &current->next;
     }
+    hasDetachedListeners = false;
 }
 
 //TODO: tmp added for hexdump
@@ -116,8 +358,8 @@ void hexdump(const void *ptr, int buflen) {
     delete[] lineBuf;
 }
 
-void HAPServer::_onRequestReceived(HAPEvent * e) {
-    auto req = new HAPUserHelper(e->arg<hap_network_connection>());
+void HAPServer::_onRequestReceived(hap_network_connection * conn) {
+    auto req = new HAPUserHelper(conn, true);
     req->retain();
 
     HAP_DEBUG("New Request to %d with method %d, length %u bytes", req->path(), req->method(), req->dataLength());
@@ -153,66 +395,347 @@ void HAPServer::_onRequestReceived(HAPEvent * e) {
             } else if (req->method() == PUT) { _handleCharacteristicWrite(req); }
             break;
         }
-        default: HAP_DEBUG("Unimplemented path: %d", req->path());
+        default: _routeRequest(req);
     }
 
     req->release();
 }
 
+static_assert((HAP_HTTP_ROUTE_SLOTS & (HAP_HTTP_ROUTE_SLOTS - 1)) == 0, "HAP_HTTP_ROUTE_SLOTS must be a power of two");
+
+/**
+ * Find the route of the request, or the free slot where it would go.
+ * The table is never more than half full, so the probing ends quickly.
+ */
+HAPRoute * HAPServer::_findRoute(hap_http_method method, const char * path, uint32_t hash) {
+    auto index = (hash ^ (static_cast<uint32_t>(method) * 0x9e3779b1u)) & (HAP_HTTP_ROUTE_SLOTS - 1);
+    for(;; index = (index + 1) & (HAP_HTTP_ROUTE_SLOTS - 1)){
+        auto route = &routes[index];
+        if(route->path == nullptr) return route;
+        if(route->hash == hash && route->method == method && strcmp(route->path, path) == 0) return route;
+    }
+}
+
+void HAPServer::_routeRequest(HAPUserHelper * req) {
+    auto header = &req->conn->user->request_header;
+    auto route = _findRoute(header->method, header->path_name, header->path_hash);
+    if(route->path == nullptr){
+        HAP_DEBUG("Unimplemented path: %s", header->path_name);
+        req->send(HTTP_404_NOT_FOUND);
+    } else if(route->verified && !req->pairInfo()->paired()){
+        req->send(HTTP_470_CONN_AUTH_REQUIRED);
+    } else { route->handler(req, route->argument); }
+}
+
+bool HAPServer::route(hap_http_method method, const char *path, HAPRouteHandler handler, void *argument, bool verified) {
+    if(method == METHOD_UNKNOWN || path == nullptr || handler == nullptr) return false;
+    if(routeCount >= HAP_HTTP_ROUTE_SLOTS / 2) return false;
+
+    //Only the paths that aren't answered by _onRequestReceived() can be routed
+    auto length = static_cast<unsigned int>(strlen(path));
+    auto served = hap_http_path_of(path, length);
+    if(served != PATH_UNKNOWN && served != IDENTIFY) return false;
+
+    auto hash = hap_http_path_hash(path, length);
+    auto route = _findRoute(method, path, hash);
+    if(route->path) return false;
+
+    route->hash = hash;
+    route->method = method;
+    route->path = path;
+    route->handler = handler;
+    route->argument = argument;
+    route->verified = verified;
+    ++routeCount;
+    return true;
+}
+
 void HAPServer::_clearEventQueue() {
     while (auto current = _dequeueEvent()){
+        //Posted values are owned by their handler
+        if(current->name == HAPEvent::HAP_CHARACTERISTIC_POSTED_VALUE)
+            delete hap_event_payload<HAPEvent::HAP_CHARACTERISTIC_POSTED_VALUE>(current);
         if(current->didEmit) current->didEmit(current);
-        delete current;
+        _releaseEvent(current);
     }
-    eventQueue = nullptr;
 }
 
 HAPEvent *HAPServer::_dequeueEvent() {
-    auto current = eventQueue;
-    if(current) eventQueue = current->next;
-    return current;
+    for(auto round = 0; round < 2; ++round){
+        //Highest lane that still has both events and credits
+        for(unsigned int lane = 0; lane < HAPEvent::LANE_COUNT; ++lane){
+            auto current = eventQueue[lane];
+            if(current == nullptr || laneCredits[lane] == 0) continue;
+            //The connection stays until the events that may refer to it are done,
+            //the lane waits behind it to keep its order
+            if(current->name == HAPEvent::HAP_NET_DISCONNECT && _hasEventsBefore(current)) continue;
+
+            --laneCredits[lane];
+            eventQueue[lane] = current->next;
+            if(!eventQueue[lane]) eventQueueTail[lane] = nullptr;
+#ifdef USE_EVENT_LOOP_STATS
+            --loopStats.queueDepth;
+#endif
+            return current;
+        }
+
+        //Every non-empty lane has used up its share, start a new round
+        for(unsigned int lane = 0; lane < HAPEvent::LANE_COUNT; ++lane)
+            laneCredits[lane] = laneWeights[lane];
+    }
+    return nullptr;
+}
+
+bool HAPServer::_hasQueuedEvents() {
+    for(auto head : eventQueue) if(head) return true;
+    return false;
+}
+
+/**
+ * Whether another lane still holds an event queued before this one. Lanes
+ * are FIFO, so only their heads need to be looked at.
+ */
+bool HAPServer::_hasEventsBefore(HAPEvent * event) {
+    for(auto head : eventQueue){
+        if(head && head != event && static_cast<int32_t>(head->sequence - event->sequence) < 0) return true;
+    }
+    return false;
+}
+
+void HAPServer::setLaneWeight(HAPEvent::Lane lane, unsigned int weight) {
+    if(lane >= HAPEvent::LANE_COUNT) return;
+    laneWeights[lane] = weight ? weight : 1;
 }
 
 HAPEventListener * HAPServer::on(HAPEvent::EventID id, HAPEventListener::Callback cb) {
-    auto listener = new HAPEventListener();
+    auto listener = _allocListener();
     listener->onEvent = cb;
     listener->listening = id;
     listener->next = nullptr;
 
-    HAPEventListener ** appendListener = &eventListeners;
+    //Listeners of an event are dispatched in the order they are added
+    HAPEventListener ** appendListener = &eventListeners[id];
     while ((*appendListener) != nullptr) appendListener = &((*appendListener)->next);
     *appendListener = listener;
 
     return listener;
 }
 
+bool HAPServer::off(HAPEventListener * listener) {
+    if(listener == nullptr || listener->listening >= HAPEvent::EVENT_COUNT) return false;
+
+    auto rm = &eventListeners[listener->listening];
+    while (*rm != nullptr && *rm != listener) rm = &(*rm)->next;
+    if(*rm == nullptr) return false;
+
+    //The list is being walked, unlink it after the dispatch finishes
+    if(dispatchingEvent == listener->listening){
+        listener->onEvent = nullptr;
+        listener->detached = true;
+        hasDetachedListeners = true;
+        return true;
+    }
+
+    *rm = listener->next;
+    _releaseListener(listener);
+    return true;
+}
+
 void HAPServer::emit(HAPEvent::EventID name, void *args, HAPEventListener::Callback onCompletion) {
-    auto event = new HAPEvent();
+    auto event = _allocEvent();
     event->name = name;
     event->argument = args;
     event->didEmit = onCompletion;
+#ifdef USE_EVENT_LOOP_STATS
+    event->emittedAt = hap_micros();
+#endif
+    //No wakeup needed: emit() runs on the loop thread, which is never blocked at this
+    //point. Events emitted by network handlers are drained as soon as hap_network_loop()
+    //returns, and other threads go through post().
+    _enqueueEvent(event);
+}
 
-    HAPEvent ** appendEvent = &eventQueue;
-    while ((*appendEvent) != nullptr) appendEvent = &((*appendEvent)->next);
-    *appendEvent = event;
+void HAPServer::post(HAPEvent::EventID name, void *args, HAPEventListener::Callback onCompletion) {
+#ifdef USE_ATOMIC_MAILBOX
+    //The pool belongs to the loop thread
+    auto event = new HAPEvent();
+    event->name = name;
+    event->argument = args;
+    event->didEmit = onCompletion;
+    event->pooled = false;
+#ifdef USE_EVENT_LOOP_STATS
+    event->emittedAt = hap_micros();
+#endif
+
+    auto head = mailbox.load(std::memory_order_relaxed);
+    do { event->next = head; }
+    while (!mailbox.compare_exchange_weak(head, event, std::memory_order_release, std::memory_order_relaxed));
+
+    //Only the first event of an empty mailbox needs to wake up the loop. Before
+    //begin() there is no loop to wake up, the event waits in the mailbox
+    if(head == nullptr) _wakeup();
+#else
+    emit(name, args, onCompletion);
+#endif
 }
 
-HAPEventListener * HAPServer::_onSelf(HAPEvent::EventID name, HAPEventListener::HAPCallback cb) {
-    auto listener = on(name, nullptr);
-    listener->_internalOnEvent = cb;
-    return listener;
+void HAPServer::_wakeup() {
+#ifdef USE_ATOMIC_MAILBOX
+    hap_network_wakeup(wakeTarget.load(std::memory_order_acquire));
+#else
+    hap_network_wakeup(server_conn);
+#endif
 }
 
-void HAPServer::_clearEventListeners() {
-    auto current = eventListeners;
+void HAPServer::_collectMailbox() {
+#ifdef USE_ATOMIC_MAILBOX
+    if(mailbox.load(std::memory_order_relaxed) == nullptr) return;
+
+    //Take everything at once, then restore the posting order
+    auto current = mailbox.exchange(nullptr, std::memory_order_acquire);
+    HAPEvent * ordered = nullptr;
     while (current != nullptr){
         auto next = current->next;
-        delete current;
+        current->next = ordered;
+        ordered = current;
         current = next;
     }
-    eventListeners = nullptr;
+
+    while (ordered != nullptr){
+        auto next = ordered->next;
+        _enqueueEvent(ordered);
+        ordered = next;
+    }
+#endif
+}
+
+void HAPServer::_enqueueEvent(HAPEvent * event) {
+    event->next = nullptr;
+    event->sequence = eventSequence++;
+
+    //Append to the tail of its lane so emitting is O(1)
+    auto lane = HAPEvent::laneOf(event->name);
+    if(eventQueueTail[lane]) eventQueueTail[lane]->next = event;
+    else eventQueue[lane] = event;
+    eventQueueTail[lane] = event;
+
+#ifdef USE_EVENT_LOOP_STATS
+    ++loopStats.emitted[event->name];
+    if(++loopStats.queueDepth > loopStats.queueHighWater) loopStats.queueHighWater = loopStats.queueDepth;
+#endif
+}
+
+void HAPServer::_clearEventListeners() {
+    for(auto& head : eventListeners){
+        auto current = head;
+        while (current != nullptr){
+            auto next = current->next;
+            _releaseListener(current);
+            current = next;
+        }
+        head = nullptr;
+    }
 }
 
+HAPEvent * HAPServer::_allocEvent() {
+    auto event = eventPool;
+    if(event){
+        eventPool = event->next;
+        --eventPoolStats.available;
+        ++eventPoolStats.hits;
+    } else {
+        //Pool drained, grow it by one. The event joins the pool once released.
+        event = new HAPEvent();
+        ++eventPoolStats.capacity;
+        ++eventPoolStats.misses;
+    }
+    return event;
+}
+
+void HAPServer::_releaseEvent(HAPEvent * event) {
+    if(!event->pooled){
+        delete event;
+        return;
+    }
+
+    event->name = HAPEvent::DUMMY;
+    event->argument = nullptr;
+    event->didEmit = nullptr;
+    event->next = eventPool;
+    eventPool = event;
+    ++eventPoolStats.available;
+}
+
+void HAPServer::_fillEventPool(unsigned int size) {
+    while (eventPoolStats.capacity < size){
+        _releaseEvent(new HAPEvent());
+        ++eventPoolStats.capacity;
+    }
+}
+
+void HAPServer::_clearEventPool() {
+    while (eventPool != nullptr){
+        auto next = eventPool->next;
+        delete eventPool;
+        eventPool = next;
+        --eventPoolStats.capacity;
+        --eventPoolStats.available;
+    }
+
+    while (listenerPool != nullptr){
+        auto next = listenerPool->next;
+        delete listenerPool;
+        listenerPool = next;
+    }
+}
+
+HAPEventListener * HAPServer::_allocListener() {
+    auto listener = listenerPool;
+    if(listener == nullptr) return new HAPEventListener();
+    listenerPool = listener->next;
+    *listener = HAPEventListener();
+    return listener;
+}
+
+void HAPServer::_releaseListener(HAPEventListener * listener) {
+    listener->next = listenerPool;
+    listenerPool = listener;
+}
+
+const HAPEventPoolStats & HAPServer::getEventPoolStats() const {
+    return eventPoolStats;
+}
+
+#ifdef USE_EVENT_LOOP_STATS
+const HAPEventLoopStats & HAPServer::getLoopStats() const {
+    return loopStats;
+}
+
+void HAPServer::resetLoopStats() {
+    //Events still in the queue are part of the new depth
+    auto depth = loopStats.queueDepth;
+    loopStats = HAPEventLoopStats();
+    loopStats.queueDepth = depth;
+    loopStats.queueHighWater = depth;
+}
+
+void HAPServer::dumpLoopStats() {
+    HAP_DEBUG("Event queue depth %u, high water %u, longest iteration %uus",
+              loopStats.queueDepth, loopStats.queueHighWater, static_cast<unsigned int>(loopStats.longestIteration));
+
+    for(unsigned int id = 0; id < HAPEvent::EVENT_COUNT; ++id){
+        if(loopStats.emitted[id] == 0 && loopStats.dispatched[id] == 0) continue;
+        HAP_DEBUG("Event %u: emitted %lu, dispatched %lu", id, loopStats.emitted[id], loopStats.dispatched[id]);
+    }
+
+    for(unsigned int i = 0; i < HAPEventLoopStats::HISTOGRAM_BUCKETS; ++i){
+        if(loopStats.dispatchLatency[i] == 0 && loopStats.handlerTime[i] == 0) continue;
+        HAP_DEBUG("%7luus: latency %lu, handler %lu", 1ul << i,
+                  loopStats.dispatchLatency[i], loopStats.handlerTime[i]);
+    }
+}
+#endif
+
 void HAPServer::_clearSubscribers() {
     auto current = subscribers;
     while (current != nullptr){
@@ -238,26 +761,39 @@ void HAPServer::_updateSDRecords() {
 }
 
 HAPServer::~HAPServer() {
-    hap_service_discovery_deinit(mdns_handle);
+    if(mdns_handle) hap_service_discovery_deinit(mdns_handle);
     mdns_handle = nullptr;
+    _collectMailbox();
+    _clearEventQueue();
+    _clearEventPool();
     //TODO: free all accessories
 }
 
-void HAPServer::_onSetupInitComplete(HAPEvent * event) {
-    pairingsManager->onPairSetupM2Finish(event->arg<hap_crypto_setup>());
+void HAPServer::_onSetupInitComplete(hap_crypto_setup * info) {
+    pairingsManager->onPairSetupM2Finish(info);
 }
 
-void HAPServer::_onSetupProofComplete(HAPEvent * event) {
-    pairingsManager->onPairSetupM4Finish(event->arg<hap_crypto_setup>());
+void HAPServer::_onSetupProofComplete(hap_crypto_setup * info) {
+    pairingsManager->onPairSetupM4Finish(info);
 }
 
-void HAPServer:: _onDataDecrypted(HAPEvent * event) {
-    auto info = event->arg<hap_crypto_info>();
-
+void HAPServer::_onDataDecrypted(hap_crypto_info * info) {
     if((info->flags) & CRYPTO_FLAG_NETWORK){ // NOLINT
+        //The connection was closed while the frame waited, its slot may already serve another one
+        if(hap_network_find(info->connId) != info->conn){
+            delete info;
+            return;
+        }
         if(hap_crypto_data_decrypt_did_succeed(info)){
             hap_http_parse(info->conn, info->rawData, info->dataLen);
         } else { hap_network_close(info->conn); }
+
+        //Decrypted in the frame buffer, which the connection reuses for the next frame
+        auto user = info->conn->user;
+        if(info->rawData && user->frameSpare == nullptr){
+            user->frameSpare = info->rawData;
+            info->rawData = nullptr;
+        }
         delete info;
         return;
     }
@@ -274,14 +810,18 @@ void HAPServer:: _onDataDecrypted(HAPEvent * event) {
     }
 }
 
-void HAPServer::_onDataEncrypted(HAPEvent * event) {
-    auto info = event->arg<hap_crypto_info>();
-
+void HAPServer::_onDataEncrypted(hap_crypto_info * info) {
     if((info->flags) & CRYPTO_FLAG_NETWORK){ // NOLINT
-        uint8_t frame[info->dataLen + 18];
-        memcpy(frame, info->aad, 2);
-        memcpy(frame + 2, info->encryptedData, info->dataLen + 16);
-        hap_network_send(info->conn, frame, info->dataLen + 18);
+        if(hap_network_find(info->connId) != info->conn){
+            delete info;
+            return;
+        }
+        //Length prefix, then the ciphertext followed by its tag
+        hap_network_iovec frame[] = {
+                { info->aad, 2 },
+                { info->encryptedData, info->dataLen + 16 }
+        };
+        hap_network_sendv(info->conn, frame, 2);
         delete info;
         return;
     }
@@ -297,21 +837,19 @@ void HAPServer::_onDataEncrypted(HAPEvent * event) {
     }
 }
 
-void HAPServer::_onDevicePair(HAPEvent * event) {
-    auto info = event->arg<hap_pair_info>();
+void HAPServer::_onDevicePair(hap_pair_info * info) {
     if(info->isPairing){
         pairingsManager->onDevicePaired(info, info->setupStore->session);
     }
 }
 
-void HAPServer::_onDeviceVerify(HAPEvent * event) {
-    auto info = event->arg<hap_pair_info>();
+void HAPServer::_onDeviceVerify(hap_pair_info * info) {
     if(info->isVerifying){
         pairingsManager->onDeviceVerified(info, info->infoStore->session);
     }
 }
 
-void HAPServer::_onInitKeypairReq(HAPEvent *) {
+void HAPServer::_onInitKeypairReq() {
     uint8_t pubKey[32], secKey[64];
     hap_crypto_longterm_keypair(pubKey, secKey);
     storage->setAccessoryLongTermKeys(pubKey, secKey);
@@ -327,6 +865,7 @@ void HAPServer::onInboundData(hap_network_connection *client, uint8_t *body, uin
     //Prepare read context
     auto crypto = info->prepare(false, client);
     crypto->encryptedData = body;
+    crypto->flags |= CRYPTO_FLAG_IN_PLACE;
     crypto->dataLen = bodyLen;
     crypto->authTag = tag;
     crypto->aadLen = 2;
@@ -400,8 +939,44 @@ void HAPServer::subscribe(HAPUserHelper *session, BaseCharacteristic *characteri
 }
 
 //TODO: "coalesce notifications whenever possible"
-void HAPServer::_onCharUpdate(HAPEvent * event) {
-    auto c = event->arg<BaseCharacteristic>();
+void HAPServer::_onCharUpdate(BaseCharacteristic * c) {
+    unsigned int len;
+    auto buf = _serializeCharEvent(c, &len);
+
+    auto current = subscribers;
+    while (current != nullptr){
+        if(c->lastOperator == nullptr || !c->lastOperator->equals(current->session)){
+            //The subscribers that can't keep up get the latest value once they drain
+            auto user = current->session->user;
+            if(user->congested) _holdCharEvent(user, c);
+            else _sendCharEvent(current->session, buf, len);
+        }
+        current = current->next;
+    }
+
+    delete[] buf;
+}
+
+void HAPServer::_onConnectionDrained(hap_network_connection * conn) {
+    auto user = conn->user;
+    unsigned int sent = 0;
+
+    //Congested again meanwhile, the rest waits for the next drain
+    while (sent < user->pending_count && !user->congested){
+        unsigned int len;
+        auto buf = _serializeCharEvent(user->pending_events[sent++], &len);
+        _sendCharEvent(conn, buf, len);
+        delete[] buf;
+    }
+
+    user->pending_count -= sent;
+    memmove(user->pending_events, user->pending_events + sent, user->pending_count * sizeof(BaseCharacteristic *));
+}
+
+/**
+ * The EVENT/1.0 body with the current value of the characteristic, to delete[]
+ */
+char * HAPServer::_serializeCharEvent(BaseCharacteristic * c, unsigned int * len) {
     BaseCharacteristic * updated[] = { c, nullptr };
     HAPSerializeOptions options;
     options.withEv = false;
@@ -409,24 +984,47 @@ void HAPServer::_onCharUpdate(HAPEvent * event) {
     options.withPerms = false;
     options.withType = false;
     options.aid = c->accessoryIdentifier;
-    unsigned int len = _serializeUpdatedCharacteristics(nullptr, 0, updated, c->lastOperator, &options);
-    auto buf = new char[len];
-    _serializeUpdatedCharacteristics(buf, len, updated, c->lastOperator, &options);
+    *len = _serializeUpdatedCharacteristics(nullptr, 0, updated, c->lastOperator, &options);
+    auto buf = new char[*len];
+    _serializeUpdatedCharacteristics(buf, *len, updated, c->lastOperator, &options);
+    return buf;
+}
 
-    auto current = subscribers;
-    while (current != nullptr){
-        if(!c->lastOperator->equals(current->session)){
-            auto receiver = new HAPUserHelper(current->session);
-            receiver->retain();
-            receiver->setContentType(HAP_JSON);
-            receiver->setResponseType(EVENT_1_0);
-            receiver->send(buf, len);
-            receiver->release();
-        }
-        current = current->next;
+void HAPServer::_sendCharEvent(hap_network_connection * conn, const char * buf, unsigned int len) {
+    auto receiver = new HAPUserHelper(conn);
+    receiver->retain();
+    receiver->setContentType(HAP_JSON);
+    receiver->setResponseType(EVENT_1_0);
+    receiver->send(buf, len);
+    receiver->release();
+}
+
+/**
+ * Remember to send the value of the characteristic once the connection
+ * drains. Only the characteristic is kept, so repeated updates take no
+ * more room and the value sent is the latest one.
+ */
+void HAPServer::_holdCharEvent(hap_user_connection * user, BaseCharacteristic * c) {
+    for(unsigned int i = 0; i < user->pending_count; ++i){
+        if(user->pending_events[i] == c) return;
     }
 
-    delete[] buf;
+    if(user->pending_count == user->pending_size){
+        auto size = user->pending_size ? user->pending_size * 2 : 4u;
+        auto pending = new BaseCharacteristic *[size];
+        if(user->pending_count) memcpy(pending, user->pending_events, user->pending_count * sizeof(BaseCharacteristic *));
+        delete[] user->pending_events;
+        user->pending_events = pending;
+        user->pending_size = size;
+    }
+    user->pending_events[user->pending_count++] = c;
+    HAP_DEBUG("Subscriber congested, holding back the event");
+}
+
+void HAPServer::_onCharPosted(HAPPostedValue * update) {
+    if(update->replica) update->characteristic->_updateValue(update->value, nullptr);
+    else update->characteristic->setValue(update->value);
+    delete update;
 }
 
 void HAPServer::unsubscribe(HAPUserHelper * user, BaseCharacteristic * characteristic) {
@@ -449,6 +1047,9 @@ void HAPServer::preDeviceDisconnection(hap_network_connection *conn) {
     auto session = new HAPUserHelper(conn);
     session->retain();
 
+    //Nothing is sent to the connection anymore
+    conn->user->pending_count = 0;
+
     //Remove user from subscriber list
     auto current = subscribers;
     CharacteristicSubscriber ** rm = &subscribers;
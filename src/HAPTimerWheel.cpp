@@ -0,0 +1,240 @@
+/**
+ * hapd
+ *
+ * Copyright 2018 Xule Zhou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "HAPTimerWheel.h"
+
+//Longest delay representable with the signed tick differences below
+#define HAP_TIMER_MAX_DELAY 0x7fffffffu
+
+static inline unsigned int _firstSlotFrom(uint64_t occupied, unsigned int from){
+    //Rotate so that slot `from` is bit 0, then count the empty slots before the next timer
+    auto rotated = from ? (occupied >> from) | (occupied << (64 - from)) : occupied;
+    return static_cast<unsigned int>(__builtin_ctzll(rotated));
+}
+
+HAPTimerWheel::~HAPTimerWheel() {
+    for(unsigned int i = 0; i < capacity; ++i) delete timers[i];
+    delete[] timers;
+}
+
+HAPTimerID HAPTimerWheel::add(uint32_t now, uint32_t delay, uint32_t interval, HAPTimerCallback cb, void * argument) {
+    if(cb == nullptr) return 0;
+
+    auto t = _allocTimer();
+    if(t == nullptr) return 0;
+
+    //Nothing is scheduled, so the wheel can jump straight to now
+    if(active == 0 && !firing) current = now;
+
+    if(delay > HAP_TIMER_MAX_DELAY) delay = HAP_TIMER_MAX_DELAY;
+    if(interval > HAP_TIMER_MAX_DELAY) interval = HAP_TIMER_MAX_DELAY;
+
+    t->callback = cb;
+    t->argument = argument;
+    t->expires = now + delay;
+    t->interval = interval;
+    t->active = true;
+    _place(t);
+    ++active;
+
+    return (static_cast<uint32_t>(t->generation) << 16) | (t->index + 1u);
+}
+
+bool HAPTimerWheel::cancel(HAPTimerID id) {
+    auto index = (id & 0xffff) - 1;
+    if((id & 0xffff) == 0 || index >= capacity) return false;
+
+    auto t = timers[index];
+    if(!t->active || t->generation != (id >> 16)) return false;
+
+    _unlink(t);
+    _freeTimer(t);
+    return true;
+}
+
+void HAPTimerWheel::advance(uint32_t now) {
+    //Jump over the ticks where nothing expires or cascades
+    while (active > 0){
+        auto tick = _nextTick();
+        if(static_cast<int32_t>(now - tick) < 0) break;
+        current = tick;
+        _processTick(now);
+        current = tick + 1;
+    }
+
+    if(static_cast<int32_t>(now + 1 - current) > 0) current = now + 1;
+}
+
+int HAPTimerWheel::nextTimeout(uint32_t now) {
+    if(active == 0) return -1;
+    auto remaining = static_cast<int32_t>(_nextTick() - now);
+    return remaining > 0 ? remaining : 0;
+}
+
+void HAPTimerWheel::_place(HAPTimer * t) {
+    auto delta = static_cast<int32_t>(t->expires - current);
+    auto expires = t->expires;
+
+    //Overdue timers go to the current tick, unless it is being fired right now
+    if(delta <= 0 && firing){
+        expires = current + 1;
+        delta = 1;
+    } else if(delta < 0){
+        expires = current;
+        delta = 0;
+    }
+
+    unsigned int level = 0;
+    while (level < LEVELS - 1 && static_cast<uint32_t>(delta) >= (1u << (BITS * (level + 1)))) ++level;
+
+    //Beyond the last level: park it as far as possible, it is re-hashed when cascading
+    if(static_cast<uint32_t>(delta) >= (1u << (BITS * LEVELS)))
+        expires = current + (1u << (BITS * LEVELS)) - 1;
+
+    auto slot = (expires >> (BITS * level)) & MASK;
+    auto head = &wheel[level][slot];
+
+    t->level = static_cast<uint8_t>(level);
+    t->slot = static_cast<uint8_t>(slot);
+    t->next = *head;
+    if(t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    occupied[level] |= 1ull << slot;
+}
+
+void HAPTimerWheel::_unlink(HAPTimer * t) {
+    *t->pprev = t->next;
+    if(t->next) t->next->pprev = t->pprev;
+    if(wheel[t->level][t->slot] == nullptr) occupied[t->level] &= ~(1ull << t->slot);
+    t->next = nullptr;
+    t->pprev = nullptr;
+}
+
+void HAPTimerWheel::_cascade(unsigned int level, unsigned int slot) {
+    auto t = wheel[level][slot];
+    wheel[level][slot] = nullptr;
+    occupied[level] &= ~(1ull << slot);
+
+    //Re-hash relative to the current tick, which moves them to lower levels
+    while (t != nullptr){
+        auto next = t->next;
+        _place(t);
+        t = next;
+    }
+}
+
+void HAPTimerWheel::_processTick(uint32_t now) {
+    auto index = current & MASK;
+
+    //Level 0 wrapped around, refill it from the level above (and so on)
+    if(index == 0){
+        for(unsigned int level = 1; level < LEVELS; ++level){
+            auto slot = (current >> (BITS * level)) & MASK;
+            _cascade(level, slot);
+            if(slot != 0) break;
+        }
+    }
+
+    firing = true;
+    while (auto t = wheel[0][index]){
+        _unlink(t);
+
+        auto cb = t->callback;
+        auto argument = t->argument;
+
+        if(t->interval){
+            t->expires += t->interval;
+            //Skip the runs missed while the loop was stalled instead of firing them all
+            //at once, the timer keeps its phase and fires again after now
+            auto late = static_cast<int32_t>(now - t->expires);
+            if(late >= 0) t->expires += (static_cast<uint32_t>(late) / t->interval + 1) * t->interval;
+            _place(t);
+        } else _freeTimer(t);
+
+        cb(argument);
+    }
+    firing = false;
+}
+
+uint32_t HAPTimerWheel::_nextTick() {
+    //A lower bound on the next tick with anything to fire or cascade
+    uint64_t c = current;
+    uint64_t distance = UINT64_MAX;
+
+    for(unsigned int level = 0; level < LEVELS; ++level){
+        if(occupied[level] == 0) continue;
+        auto shift = BITS * level;
+        //First slot boundary of this level at or after the current tick
+        uint64_t boundary = (c + (1ull << shift) - 1) >> shift;
+        auto k = boundary + _firstSlotFrom(occupied[level], static_cast<unsigned int>(boundary & MASK));
+        auto d = (k << shift) - c;
+        if(d < distance) distance = d;
+    }
+
+    return current + static_cast<uint32_t>(distance);
+}
+
+HAPTimer * HAPTimerWheel::_allocTimer() {
+    if(freeTimers == nullptr){
+        if(capacity >= MAX_TIMERS) return nullptr;
+
+        //Grow the table, timers themselves never move
+        auto newCapacity = capacity ? capacity * 2 : 16;
+        if(newCapacity > MAX_TIMERS) newCapacity = MAX_TIMERS;
+        auto table = new HAPTimer*[newCapacity];
+        for(unsigned int i = 0; i < capacity; ++i) table[i] = timers[i];
+        for(unsigned int i = capacity; i < newCapacity; ++i){
+            auto t = new HAPTimer();
+            t->index = static_cast<uint16_t>(i);
+            table[i] = t;
+        }
+        delete[] timers;
+        timers = table;
+
+        //Chain the new ones in ascending order
+        for(auto i = newCapacity; i > capacity; --i){
+            timers[i - 1]->next = freeTimers;
+            freeTimers = timers[i - 1];
+        }
+        capacity = newCapacity;
+    }
+
+    auto t = freeTimers;
+    freeTimers = t->next;
+    t->next = nullptr;
+    return t;
+}
+
+void HAPTimerWheel::_freeTimer(HAPTimer * t) {
+    //Invalidate the id handed out for this timer
+    ++t->generation;
+    t->active = false;
+    t->callback = nullptr;
+    t->argument = nullptr;
+    t->next = freeTimers;
+    freeTimers = t;
+    --active;
+}
@@ -0,0 +1,135 @@
+/**
+ * hapd
+ *
+ * Copyright 2018 Xule Zhou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HAPD_HAPTIMERWHEEL_H
+#define HAPD_HAPTIMERWHEEL_H
+
+#include "common.h"
+
+typedef void (*HAPTimerCallback)(void * argument);
+
+/**
+ * Identifies a timer scheduled on HAPTimerWheel. 0 is never a valid id,
+ * and the id of a finished or cancelled timer is never reused right away.
+ */
+typedef uint32_t HAPTimerID;
+
+struct HAPTimer {
+private:
+    friend class HAPTimerWheel;
+
+    HAPTimerCallback callback = nullptr;
+    void * argument = nullptr;
+
+    uint32_t expires = 0;
+    //0 for one-shot timers
+    uint32_t interval = 0;
+
+    uint16_t index = 0;
+    uint16_t generation = 0;
+    bool active = false;
+    uint8_t level = 0;
+    uint8_t slot = 0;
+
+    HAPTimer * next = nullptr;
+    HAPTimer ** pprev = nullptr;
+};
+
+/**
+ * A hierarchical timing wheel with millisecond ticks
+ *
+ * Timers are hashed into 4 levels of 64 slots each, level n covering
+ * delays up to 64^(n+1) ms. Scheduling and cancelling are O(1), and
+ * timers in the upper levels cascade down as time goes by. Delays
+ * longer than ~4.6 hours are parked in the last level and re-hashed
+ * when they cascade.
+ */
+class HAPTimerWheel {
+public:
+    ~HAPTimerWheel();
+
+    /**
+     * Schedule a callback
+     *
+     * @param now Current time in ms
+     * @param delay Milliseconds until the first expiry
+     * @param interval Milliseconds between repeats, 0 for a one-shot timer
+     * @return Timer id, 0 if no more timers can be created
+     */
+    HAPTimerID add(uint32_t now, uint32_t delay, uint32_t interval, HAPTimerCallback, void * argument);
+
+    /**
+     * Cancel a scheduled timer
+     *
+     * @return false if the timer has already finished or been cancelled
+     */
+    bool cancel(HAPTimerID);
+
+    /**
+     * Fire all the timers expiring at or before now
+     */
+    void advance(uint32_t now);
+
+    /**
+     * @return Milliseconds until the wheel needs to advance again,
+     * or -1 if no timer is scheduled
+     */
+    int nextTimeout(uint32_t now);
+
+    /**
+     * @return Number of scheduled timers
+     */
+    unsigned int count() const { return active; }
+
+private:
+    SCONST unsigned int BITS = 6;
+    SCONST unsigned int SLOTS = 1u << BITS;
+    SCONST unsigned int MASK = SLOTS - 1;
+    SCONST unsigned int LEVELS = 4;
+    SCONST unsigned int MAX_TIMERS = 0xffff;
+
+    void _place(HAPTimer *);
+    void _unlink(HAPTimer *);
+    void _cascade(unsigned int level, unsigned int slot);
+    void _processTick(uint32_t now);
+    uint32_t _nextTick();
+    HAPTimer * _allocTimer();
+    void _freeTimer(HAPTimer *);
+
+    HAPTimer * wheel[LEVELS][SLOTS] = {};
+    uint64_t occupied[LEVELS] = {};
+
+    //The next tick to be processed
+    uint32_t current = 0;
+    unsigned int active = 0;
+    bool firing = false;
+
+    //All timers ever allocated, indexed by HAPTimer::index
+    HAPTimer ** timers = nullptr;
+    unsigned int capacity = 0;
+    HAPTimer * freeTimers = nullptr;
+};
+
+#endif //HAPD_HAPTIMERWHEEL_H
@@ -29,21 +29,21 @@
 #include "tlv.h"
 #include <cstring>
 
-HAPUserHelper::HAPUserHelper(hap_network_connection *conn):
-        conn(conn), refCount(0){ }
+HAPUserHelper::HAPUserHelper(hap_network_connection *conn, bool request):
+        conn(conn), refCount(0), request(request){ }
 
 void HAPUserHelper::setResponseStatus(int status) {
-    conn->user->response_header->status = static_cast<uint16_t>(status);
+    conn->user->response_header.status = static_cast<uint16_t>(status);
 }
 
 void HAPUserHelper::setBody(const void *body, unsigned int contentLength) {
     conn->user->response_buffer = const_cast<uint8_t *>(reinterpret_cast<const uint8_t *>(body));
-    conn->user->response_header->content_length = contentLength;
-    if(conn->user->response_header->status == 204) setResponseStatus(200);
+    conn->user->response_header.content_length = contentLength;
+    if(conn->user->response_header.status == 204) setResponseStatus(200);
 }
 
 void HAPUserHelper::setResponseType(hap_msg_type type) {
-    conn->user->response_header->message_type = type;
+    conn->user->response_header.message_type = type;
 }
 
 void HAPUserHelper::send(const void *body, unsigned int contentLength) {
@@ -51,7 +51,7 @@ void HAPUserHelper::send(const void *body, unsigned int contentLength) {
     extern void hexdump(const void *ptr, int buflen);
     if(body != nullptr && contentLength > 0) setBody(body, contentLength);
     //TODO: remove
-    HAP_DEBUG("HTTP Message sending...status %d, len %d", conn->user->response_header->status, conn->user->response_header->content_length);
+    HAP_DEBUG("HTTP Message sending...status %d, len %d", conn->user->response_header.status, conn->user->response_header.content_length);
     hexdump(body, contentLength);
     send();
 }
@@ -70,19 +70,19 @@ void HAPUserHelper::send(const char *body) {
 void HAPUserHelper::send(tlv8_item * chain) {
     unsigned int len;
     auto buf = tlv8_export_free(chain, &len);
-    if(conn->user->response_header->content_type == CONTENT_TYPE_UNKNOWN) setContentType(HAP_PAIRING_TLV8);
-    if(conn->user->response_header->status == 204) setResponseStatus(200);
+    if(conn->user->response_header.content_type == CONTENT_TYPE_UNKNOWN) setContentType(HAP_PAIRING_TLV8);
+    if(conn->user->response_header.status == 204) setResponseStatus(200);
     send(buf, len);
     delete[] buf;
 }
 
 void HAPUserHelper::setContentType(hap_http_content_type ctype) {
-    conn->user->response_header->content_type = ctype;
+    conn->user->response_header.content_type = ctype;
 }
 
 HAPUserHelper::~HAPUserHelper() {
-    //Clean buffer after helper is destroyed
-    hap_network_flush(conn);
+    //Clean buffer after the request is answered, events leave it to its own helper
+    if(request) hap_network_flush(conn);
     conn->user->response_buffer = nullptr;
     conn = nullptr;
     HAP_DEBUG("Session finished.");
@@ -104,15 +104,19 @@ unsigned int HAPUserHelper::dataLength() {
 }
 
 hap_http_path HAPUserHelper::path() {
-    return conn->user->request_header->path;
+    return conn->user->request_header.path;
 }
 
 hap_http_content_type HAPUserHelper::requestContentType() {
-    return conn->user->request_header->content_type;
+    return conn->user->request_header.content_type;
 }
 
 hap_http_method HAPUserHelper::method() {
-    return conn->user->request_header->method;
+    return conn->user->request_header.method;
+}
+
+const char * HAPUserHelper::pathName() {
+    return conn->user->request_header.path_name;
 }
 
 void HAPUserHelper::close() {
@@ -136,5 +140,5 @@ void HAPUserHelper::send() {
 }
 
 const hap_http_request_parameters *HAPUserHelper::params() {
-    return &conn->user->request_header->parameters;
+    return &conn->user->request_header.parameters;
 }
@@ -26,6 +26,10 @@
 #include <utility>
 #include "common.h"
 
+#ifdef USE_ATOMIC_MAILBOX
+#include <atomic>
+#endif
+
 class HAPServer;
 class HAPUserHelper;
 class HAPPairingsManager;
@@ -40,6 +44,7 @@ struct tlv8_item;
 #include "hap_events.h"
 #include "hap_formats.h"
 #include "hap_pair_info.h"
+#include "HAPTimerWheel.h"
 
 unsigned int _nextIid(HAPServer *);
 
@@ -51,6 +56,15 @@ struct HAPSerializeOptions {
     unsigned int aid = 0;
 };
 
+//Argument of HAP_CHARACTERISTIC_POSTED_VALUE
+struct HAPPostedValue {
+    BaseCharacteristic * characteristic;
+    CharacteristicValue value;
+
+    //Set by another shard, which already notified the rest of the group
+    bool replica;
+};
+
 class BaseCharacteristic {
 public:
     SCONST uint32_t type = 0x00000000;
@@ -66,6 +80,16 @@ protected:
 
     void setValue(CharacteristicValue v, HAPUserHelper * sender = nullptr);
 
+    /**
+     * setValue() without replicating the value to the other shards
+     */
+    void _updateValue(CharacteristicValue v, HAPUserHelper * sender);
+
+    /**
+     * Thread-safe setValue(): the value is applied on the event loop
+     */
+    void postValue(CharacteristicValue v);
+
     unsigned int instanceIdentifier = 0;
     unsigned int accessoryIdentifier = 0;
     uint32_t characteristicTypeIdentifier = 0;
@@ -171,9 +195,91 @@ public:
 
     /**
      * Must be called in every loop
+     *
+     * Polls the network and dispatches queued events until the
+     * queue is empty or the budget set by setLoopBudget() runs out.
      */
     void handle();
 
+    /**
+     * Limit the work done by a single call to handle()
+     *
+     * @param maxEvents Max events dispatched per call, 0 for no limit
+     * @param maxMillis Max milliseconds spent dispatching per call, 0 for no limit
+     */
+    void setLoopBudget(unsigned int maxEvents, unsigned int maxMillis = 0);
+
+    /**
+     * Set how many events of a lane may be dispatched in a round before
+     * the lower lanes get their turn. Defaults are 8, 4 and 1, so a
+     * pairing in progress can't hold back requests from other
+     * controllers, and still never starves.
+     *
+     * @param weight Events per round, at least 1
+     */
+    void setLaneWeight(HAPEvent::Lane, unsigned int weight);
+
+    /**
+     * Run the event loop until stop() is called, sleeping in the
+     * network backend whenever there is nothing to do.
+     *
+     * @note Only for platforms with a blocking network backend. On
+     * Arduino, keep calling HAPServer::handle() in loop() instead.
+     */
+    void run();
+
+    /**
+     * Run a single iteration of the event loop: wait for network
+     * activity, then dispatch events like handle() does. Returns
+     * without waiting if events are already queued.
+     *
+     * @param timeout Max milliseconds to wait, -1 to wait until
+     * something happens
+     */
+    void runOnce(int timeout = -1);
+
+    /**
+     * Make run() return after the current iteration. Can be called
+     * from an event handler or another thread.
+     */
+    void stop();
+
+    /**
+     * The followings embed the server in a host that runs its own
+     * event loop: watch the descriptors from getPollDescriptors() and
+     * wait no longer than getPollTimeout(), then call processReady()
+     * for each ready descriptor, or processPending() on timeouts.
+     */
+
+    /**
+     * Get the descriptors to watch for readiness. Query them again
+     * after each call into the server, since they change as
+     * connections come and go.
+     *
+     * @return Number of descriptors, which can be more than max
+     */
+    unsigned int getPollDescriptors(hap_network_pollfd * fds, unsigned int max);
+
+    /**
+     * @return Milliseconds before processPending() has to run, 0 if
+     * there is work queued and -1 if nothing is scheduled
+     */
+    int getPollTimeout();
+
+    /**
+     * Handle a ready descriptor, then do what processPending() does
+     *
+     * @param fd Ready descriptor
+     * @param events Ready events, with poll(2) event bits
+     */
+    void processReady(int fd, short events);
+
+    /**
+     * Do the network work left from previous calls, fire due timers and
+     * dispatch queued events within the loop budget
+     */
+    void processPending();
+
     /**
      * Get the accessory with aid. Pass 1 to obtain the main
      * accessory for this server.
@@ -214,8 +320,128 @@ public:
 
     //node-like event system but non-blocking so no wdt triggers :D
     HAPEventListener * on(HAPEvent::EventID, HAPEventListener::Callback);
+
+    /**
+     * Register a handler taking the payload type of the event, e.g.
+     * on<HAPEvent::HAPCRYPTO_NEED_DECRYPT, &decrypt>() with
+     * void decrypt(hap_crypto_info *). The handler is bound at compile
+     * time, so its call can be inlined into the listener.
+     */
+    template<HAPEvent::EventID ID, void (*Handler)(typename HAPEventPayload<ID>::type *)>
+    HAPEventListener * on(){ return on(ID, &_typedListener<ID, Handler>); }
+
+    /**
+     * Unregister a listener returned by HAPServer::on(). Safe to call
+     * from within an event handler, including the listener's own.
+     *
+     * @return false if the listener is not registered to this server
+     */
+    bool off(HAPEventListener *);
     void emit(HAPEvent::EventID, void * args = nullptr, HAPEventListener::Callback onCompletion = nullptr);
 
+    /**
+     * emit() which only accepts the payload type of the event
+     */
+    template<HAPEvent::EventID ID>
+    void emit(typename HAPEventPayload<ID>::type * args = nullptr, HAPEventListener::Callback onCompletion = nullptr){
+        emit(ID, args, onCompletion);
+    }
+
+    /**
+     * Thread-safe emit(). The event goes through a lock-free mailbox
+     * and the loop is woken up to queue it, so it can be called from
+     * any thread without locking, even while begin() runs. Events
+     * posted before begin() are delivered once the loop runs.
+     *
+     * @note Without USE_ATOMIC_MAILBOX (e.g. on Arduino) this is emit()
+     */
+    void post(HAPEvent::EventID, void * args = nullptr, HAPEventListener::Callback onCompletion = nullptr);
+
+    template<HAPEvent::EventID ID>
+    void post(typename HAPEventPayload<ID>::type * args = nullptr, HAPEventListener::Callback onCompletion = nullptr){
+        post(ID, args, onCompletion);
+    }
+
+    /**
+     * Allocation counters of the HAPEvent pool. Once the pool has
+     * grown to the peak queue depth, misses should stop increasing.
+     */
+    const HAPEventPoolStats & getEventPoolStats() const;
+
+#ifdef USE_EVENT_LOOP_STATS
+    /**
+     * Event counters, queue depth and latency histograms of the loop
+     */
+    const HAPEventLoopStats & getLoopStats() const;
+
+    void resetLoopStats();
+
+    /**
+     * Print the loop statistics with HAP_DEBUG
+     */
+    void dumpLoopStats();
+#endif
+
+    /**
+     * Call the callback once after the given delay. Timers run on the
+     * event loop, and the loop sleeps no longer than the next expiry.
+     *
+     * @param ms Delay in milliseconds
+     * @return Timer id to be used with clearTimer(), 0 if it cannot be scheduled
+     */
+    HAPTimerID setTimeout(unsigned int ms, HAPTimerCallback, void * argument = nullptr);
+
+    /**
+     * Call the callback every ms milliseconds until cleared
+     *
+     * @return Timer id to be used with clearTimer(), 0 if it cannot be scheduled
+     */
+    HAPTimerID setInterval(unsigned int ms, HAPTimerCallback, void * argument = nullptr);
+
+    /**
+     * Cancel a timer created with setTimeout() or setInterval()
+     *
+     * @return false if the timer has already fired or been cleared
+     */
+    bool clearTimer(HAPTimerID);
+
+    /**
+     * Answer requests to a path hapd doesn't serve itself, such as
+     * /identify or the application's own endpoints. The handler gets
+     * the request like the built-in ones do. Requests from controllers
+     * that haven't completed pair verify get 470 instead, unless
+     * verified is false, and paths that aren't routed get 404.
+     *
+     * @note The path is not copied. On shards, add the routes to every
+     * server of the group.
+     *
+     * @param method Method of the requests
+     * @param path Path of the requests without the query, case sensitive
+     * @param verified Whether the controller must have completed pair verify
+     * @return false if hapd serves the path, it is already routed for the
+     * method, or the table is full (see HAP_HTTP_ROUTE_SLOTS)
+     */
+    bool route(hap_http_method method, const char * path, HAPRouteHandler handler,
+               void * argument = nullptr, bool verified = true);
+
+#ifdef USE_HAP_SHARDS
+    /**
+     * Add a server to run on its own thread alongside this one. The
+     * shard shares the pairings of this server and listens on the same
+     * port, with the kernel spreading the connections among the group
+     * (see HAP_SOCK_REUSEPORT). A characteristic set on any server of
+     * the group is posted to the others, which notify their own
+     * subscribers.
+     *
+     * @note The shard must have the same accessories, services and
+     * characteristics added in the same order. Call begin() on this
+     * server first, then on each shard from its own thread.
+     *
+     * @note Only built with -DUSE_HAP_SHARDS
+     */
+    void addShard(HAPServer *);
+#endif
+
     const char * modelName = "HomeKitDevice1,1";
     const char * deviceName = "HomeKit Device";
 
@@ -239,23 +465,47 @@ private:
     unsigned int instanceIdPool = 1;
 
 private:
-    HAPEventListener * _onSelf(HAPEvent::EventID, HAPEventListener::HAPCallback);
+    template<HAPEvent::EventID ID, void (*Handler)(typename HAPEventPayload<ID>::type *)>
+    static void _typedListener(HAPEvent * event){ Handler(hap_event_payload<ID>(event)); }
+
     void _clearEventQueue();
     void _clearEventListeners();
+    void _clearEventPool();
+    void _fillEventPool(unsigned int size);
+    HAPEvent * _allocEvent();
+    void _releaseEvent(HAPEvent *);
+    HAPEventListener * _allocListener();
+    void _releaseListener(HAPEventListener *);
     void _clearSubscribers();
     HAPEvent * _dequeueEvent();
-
-    void _onRequestReceived(HAPEvent *);
-    void _onSetupInitComplete(HAPEvent *);
-    void _onSetupProofComplete(HAPEvent *);
-    void _onDataDecrypted(HAPEvent *);
-    void _onDataEncrypted(HAPEvent *);
-    void _onInitKeypairReq(HAPEvent *);
-    void _onDevicePair(HAPEvent *);
-    void _onDeviceVerify(HAPEvent *);
-    void _onCharUpdate(HAPEvent *);
+    void _dispatchEvent(HAPEvent *);
+    void _dispatchInternal(HAPEvent *);
+    void _drainEvents();
+    int _nextTimeout(int timeout);
+    void _processIteration();
+    void _sweepDetachedListeners(HAPEvent::EventID);
+
+    void _onRequestReceived(hap_network_connection *);
+    HAPRoute * _findRoute(hap_http_method, const char * path, uint32_t hash);
+    void _routeRequest(HAPUserHelper *);
+    void _onSetupInitComplete(hap_crypto_setup *);
+    void _onSetupProofComplete(hap_crypto_setup *);
+    void _onDataDecrypted(hap_crypto_info *);
+    void _onDataEncrypted(hap_crypto_info *);
+    void _onInitKeypairReq();
+    void _onDevicePair(hap_pair_info *);
+    void _onDeviceVerify(hap_pair_info *);
+    void _onCharUpdate(BaseCharacteristic *);
+    void _onConnectionDrained(hap_network_connection *);
+    char * _serializeCharEvent(BaseCharacteristic *, unsigned int * len);
+    void _sendCharEvent(hap_network_connection *, const char * buf, unsigned int len);
+    void _holdCharEvent(hap_user_connection *, BaseCharacteristic *);
+    void _onCharPosted(HAPPostedValue *);
 
     void _updateSDRecords();
+#ifdef USE_HAP_SHARDS
+    void _replicateValue(BaseCharacteristic *);
+#endif
 
     void _handleCharacteristicWrite(HAPUserHelper *);
     void _sendAttributionDatabase(HAPUserHelper *);
@@ -265,12 +515,47 @@ private:
     unsigned int _serializeUpdatedCharacteristics(char *, unsigned int len, BaseCharacteristic **, HAPUserHelper *, HAPSerializeOptions * options);
 
     hap_network_connection * server_conn = nullptr;
-    HAPEvent * eventQueue = nullptr;
-    HAPEventListener * eventListeners = nullptr;
+    bool _hasQueuedEvents();
+    bool _hasEventsBefore(HAPEvent *);
+    void _enqueueEvent(HAPEvent *);
+    void _collectMailbox();
+    void _wakeup();
+
+    HAPEvent * eventQueue[HAPEvent::LANE_COUNT] = {};
+    HAPEvent * eventQueueTail[HAPEvent::LANE_COUNT] = {};
+    unsigned int laneWeights[HAPEvent::LANE_COUNT] = { 8, 4, 1 };
+    unsigned int laneCredits[HAPEvent::LANE_COUNT] = {};
+    uint32_t eventSequence = 0;
+    unsigned int loopEventBudget = HAP_LOOP_EVENT_BUDGET;
+    unsigned int loopTimeBudget = HAP_LOOP_TIME_BUDGET;
+    volatile bool loopRunning = false;
+    HAPEventListener * eventListeners[HAPEvent::EVENT_COUNT] = {};
+    HAPEvent::EventID dispatchingEvent = HAPEvent::EVENT_COUNT;
+    bool hasDetachedListeners = false;
+    HAPEvent * eventPool = nullptr;
+    HAPEventPoolStats eventPoolStats;
+    HAPEventListener * listenerPool = nullptr;
+    HAPTimerWheel timers;
+#ifdef USE_ATOMIC_MAILBOX
+    //Events posted by other threads, newest first
+    std::atomic<HAPEvent *> mailbox { nullptr };
+    //server_conn as seen by other threads, published once bound by begin()
+    std::atomic<hap_network_connection *> wakeTarget { nullptr };
+#endif
+#ifdef USE_EVENT_LOOP_STATS
+    HAPEventLoopStats loopStats;
+#endif
     HAPPairingsManager * pairingsManager = nullptr;
     HAPPersistingStorage * storage = nullptr;
     BaseAccessory * accessories = nullptr;
     CharacteristicSubscriber * subscribers = nullptr;
+    HAPRoute routes[HAP_HTTP_ROUTE_SLOTS];
+    unsigned int routeCount = 0;
+#ifdef USE_HAP_SHARDS
+    //The server that owns the pairings, nullptr for the owner itself
+    HAPServer * primary = nullptr;
+    HAPServer * nextShard = nullptr;
+#endif
 
 private:
     friend class HAPPairingsManager;
@@ -91,8 +91,7 @@ void _async_math_expmod_cleanup(_async_math_expmod_info * info){
     delete info;
 }
 
-void _async_math_expmod_final(HAPEvent * event){
-    auto info = event->arg<_async_math_expmod_info>();
+void _async_math_expmod_final(_async_math_expmod_info * info){
     auto& ret = info->ret;
 
     /*
@@ -123,8 +122,7 @@ void _async_math_expmod_final(HAPEvent * event){
     _async_math_expmod_cleanup(info);
 }
 
-void _async_math_expmod_body(HAPEvent * event){
-    auto info = event->arg<_async_math_expmod_info>();
+void _async_math_expmod_body(_async_math_expmod_info * info){
     auto& ret = info->ret;
 
     if( info->bufsize == 0 )
@@ -183,11 +181,11 @@ void _async_math_expmod_body(HAPEvent * event){
     }
 
     _continue:
-    info->loop->emit(HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_BODY, info);
+    info->loop->emit<HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_BODY>(info);
     return;
 
     _break:
-    info->loop->emit(HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_FINAL, info);
+    info->loop->emit<HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_FINAL>(info);
     return;
 
     cleanup:
@@ -316,14 +314,9 @@ void hap_crypto_math_expmod(
     info->wbits   = 0;
     info->state   = 0;
 
-    info->loop->emit(HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_BODY, info);
+    info->loop->emit<HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_BODY>(info);
     return;
     cleanup: _async_math_expmod_cleanup(info);
 }
 
-void hap_crypto_math_init(HAPServer * loop) {
-    loop->on(HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_BODY, _async_math_expmod_body);
-    loop->on(HAPEvent::HAPCRYPTO_ASYNC_EXPMOD_FINAL, _async_math_expmod_final);
-}
-
 #endif
@@ -28,6 +28,10 @@
 //Async math functions: enabling this makes computations longer, but avoid wdt triggers
 #ifdef USE_ASYNC_MATH
 
+#include "crypto/bignum.h"
+
+struct _async_math_expmod_info;
+
 /**
  * Make this async
  *
@@ -52,6 +56,11 @@ void hap_crypto_math_expmod(
         void (*callback)(void *, int)
 );
 
-void hap_crypto_math_init(HAPServer *);
+/**
+ * Steps of hap_crypto_math_expmod(), run by HAPServer::_dispatchInternal()
+ * on HAPCRYPTO_ASYNC_EXPMOD_BODY and HAPCRYPTO_ASYNC_EXPMOD_FINAL
+ */
+void _async_math_expmod_body(_async_math_expmod_info *);
+void _async_math_expmod_final(_async_math_expmod_info *);
 
 #endif
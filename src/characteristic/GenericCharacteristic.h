@@ -40,6 +40,9 @@ public:
 
     void set(ResT v){ setValue(static_cast<CharacteristicValue>(v)); }
 
+    //Same as set(), but can be called from any thread
+    void post(ResT v){ postValue(static_cast<CharacteristicValue>(v)); }
+
     SCONST uint32_t type = static_cast<uint32_t>(UUID);
 };
 
@@ -34,6 +34,12 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <time.h>
+#endif
+
 #ifndef HAP_DEBUG
 
 #if defined(USE_HARDWARE_SERIAL)
@@ -55,6 +61,111 @@
 #define HAP_SOCK_TCP_NODELAY 1
 #endif
 
+#ifndef HAP_SOCK_REUSEPORT
+#ifdef USE_HAP_SHARDS
+//Let the servers of a shard group listen on the same port
+#define HAP_SOCK_REUSEPORT 1
+#else
+#define HAP_SOCK_REUSEPORT 0
+#endif
+#endif
+
+#ifndef HAP_LOOP_EVENT_BUDGET
+//Max events dispatched in one HAPServer::handle(), 0 for no limit
+#define HAP_LOOP_EVENT_BUDGET 0
+#endif
+
+#ifndef HAP_LOOP_TIME_BUDGET
+//Max milliseconds spent dispatching in one HAPServer::handle(), 0 for no limit
+#ifdef USE_ASYNC_MATH
+#define HAP_LOOP_TIME_BUDGET 10
+#else
+#define HAP_LOOP_TIME_BUDGET 0
+#endif
+#endif
+
+#ifndef HAP_EVENT_POOL_SIZE
+//Number of events preallocated by HAPServer::begin(), the pool grows past this on demand
+#define HAP_EVENT_POOL_SIZE 16
+#endif
+
+#ifndef HAP_NETWORK_OUTPUT_HIGH_WATERMARK
+//Bytes queued for a connection above which it is reported as congested
+#define HAP_NETWORK_OUTPUT_HIGH_WATERMARK 16384
+#endif
+
+#ifndef HAP_NETWORK_OUTPUT_LOW_WATERMARK
+//Bytes queued for a congested connection below which it recovers
+#define HAP_NETWORK_OUTPUT_LOW_WATERMARK 4096
+#endif
+
+#ifndef HAP_NETWORK_OUTPUT_LIMIT
+//Connections that let more than this many bytes pile up are closed
+#define HAP_NETWORK_OUTPUT_LIMIT 262144
+#endif
+
+#ifndef HAP_NETWORK_READ_BUDGET
+//Bytes read from a connection in a turn of the loop before the other ready
+//connections are served, the rest is read on the next turn. 0 for no limit
+#define HAP_NETWORK_READ_BUDGET 8192
+#endif
+
+#ifndef HAP_HTTP_MAX_HEADER
+//Bytes of request line and headers a request may have. Each connection
+//keeps a buffer of this size, longer requests close the connection
+#define HAP_HTTP_MAX_HEADER 1024
+#endif
+
+#ifndef HAP_HTTP_MAX_BODY
+//Largest Content-Length accepted, larger requests close the connection
+#define HAP_HTTP_MAX_BODY 16384
+#endif
+
+#ifndef HAP_HTTP_MAX_PIPELINE
+//Bytes of requests that may wait behind one that hasn't been answered,
+//more close the connection
+#define HAP_HTTP_MAX_PIPELINE 8192
+#endif
+
+#ifndef HAP_HTTP_ROUTE_SLOTS
+//Slots of the hash table of HAPServer::route(), a power of two. Only half
+//of them can be used, so that most lookups take a single probe
+#define HAP_HTTP_ROUTE_SLOTS 16
+#endif
+
+#ifndef HAP_NETWORK_MAX_CONNECTIONS
+//Open connections above which the least recently active one is evicted,
+//unverified connections first. 0 for no limit
+#define HAP_NETWORK_MAX_CONNECTIONS 64
+#endif
+
+#ifndef HAP_NETWORK_UNVERIFIED_TIMEOUT
+//Milliseconds of silence after which a connection that hasn't completed
+//pair verify is closed, 0 to keep it open
+#define HAP_NETWORK_UNVERIFIED_TIMEOUT 60000
+#endif
+
+#ifndef HAP_NETWORK_IDLE_TIMEOUT
+//Same for verified connections. Controllers stay silent while they wait
+//for events, so they are left to TCP keepalive by default
+#define HAP_NETWORK_IDLE_TIMEOUT 0
+#endif
+
+#ifndef HAP_SOCK_KEEPALIVE_IDLE
+//Seconds of silence before TCP keepalive probes are sent, 0 to disable
+#define HAP_SOCK_KEEPALIVE_IDLE 60
+#endif
+
+#ifndef HAP_SOCK_KEEPALIVE_INTERVAL
+//Seconds between keepalive probes
+#define HAP_SOCK_KEEPALIVE_INTERVAL 10
+#endif
+
+#ifndef HAP_SOCK_KEEPALIVE_COUNT
+//Unanswered probes after which the connection is dropped
+#define HAP_SOCK_KEEPALIVE_COUNT 3
+#endif
+
 #ifndef HAP_NOTHING
 #define HAP_NOTHING
 #endif
@@ -70,7 +181,43 @@
 #define HTTP_500_INTERNAL_ERROR         500
 #define HTTP_503_SERVICE_UNAVAILABLE    503
 
+/**
+ * Monotonic clock in milliseconds, wraps around after ~49 days
+ */
+inline uint32_t hap_millis(){
+#ifdef ARDUINO
+    return static_cast<uint32_t>(millis());
+#else
+    timespec ts {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint32_t>(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+/**
+ * Monotonic clock in microseconds, wraps around after ~71 minutes
+ */
+inline uint32_t hap_micros(){
+#ifdef ARDUINO
+    return static_cast<uint32_t>(micros());
+#else
+    timespec ts {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint32_t>(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#endif
+}
+
+/**
+ * Microseconds elapsed since a hap_micros() timestamp. The unsigned
+ * subtraction stays right across the wrap around, as long as the
+ * interval itself is shorter than ~71 minutes.
+ */
+inline uint32_t hap_micros_since(uint32_t start){
+    return hap_micros() - start;
+}
+
 class HAPServer;
+class BaseCharacteristic;
 struct hap_pair_info;
 struct hap_crypto_info;
 struct hap_crypto_verify;
@@ -94,6 +241,15 @@ enum hap_http_path {
     PAIRINGS
 };
 
+//Progress of the request being received, see hap_http_parse()
+enum hap_http_parse_state {
+    HTTP_PARSE_REQUEST_LINE,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_BODY,
+    HTTP_PARSE_COMPLETE, // Waiting for hap_network_flush()
+    HTTP_PARSE_FAILED // Malformed, the connection is being closed
+};
+
 enum hap_http_content_type {
     CONTENT_TYPE_UNKNOWN,
     HAP_PAIRING_TLV8, // application/pairing+tlv8
@@ -115,6 +271,9 @@ struct hap_http_description {
     hap_msg_type message_type = HTTP_1_1;
     hap_http_method method = METHOD_UNKNOWN;
     hap_http_path path = PATH_UNKNOWN;
+    //Path as requested without the query, used to route PATH_UNKNOWN
+    const char * path_name = nullptr;
+    uint32_t path_hash = 0;
     const char * host = nullptr;
     uint16_t status = 204;//Default to 204 no content
     unsigned int content_length = 0;
@@ -122,25 +281,77 @@ struct hap_http_description {
     hap_http_request_parameters parameters;
 };
 
+//Bytes the header scanner may read past the data, a full AVX2 vector
+#define HAP_HTTP_SCAN_PADDING 32
+
 //Contains information for requests & responses
 struct hap_user_connection {
-    hap_http_description * request_header;
+    hap_http_description request_header;
+    //Request body, kept across requests and only grown
     uint8_t * request_buffer;
+    unsigned int request_buffer_size;
     unsigned int request_current_length;
     hap_pair_info * pair_info;
 
-    hap_http_description * response_header;
+    hap_http_description response_header;
     uint8_t * response_buffer;
 
+    //Request line and headers are copied here line by line as they arrive.
+    //The path, host and id strings of request_header point into it
+    hap_http_parse_state parse_state;
+    unsigned int head_length;
+    unsigned int line_start;
+    unsigned int line_colon; // Offset of the colon in the header line, 0 until found
+    char head[HAP_HTTP_MAX_HEADER + HAP_HTTP_SCAN_PADDING];
+
+    //Bytes received behind a complete request, parsed once it is flushed
+    uint8_t * pipeline_buffer;
+    unsigned int pipeline_length;
+    unsigned int pipeline_size;
+
+    //The encrypted frame being received, in a buffer that fits the largest
+    //frame. Frames are decrypted in place and their buffer comes back as the
+    //spare, so a connection reading one frame at a time doesn't allocate
     uint8_t * frameBuf;
+    uint8_t * frameSpare;
     unsigned int frameBufCurrLen;
     unsigned int frameExpLen;
+
+    //Length prefix of the next frame, which may arrive split
+    uint8_t frameHeader[2];
+    uint8_t frameHeaderLen;
+
+    //Too much output is waiting to be sent, see hap_event_network_congestion()
+    bool congested;
+
+    //Characteristics updated while congested, once each, whose latest values
+    //are sent when the connection drains. Kept across congestions and only grown
+    BaseCharacteristic ** pending_events;
+    unsigned int pending_count;
+    unsigned int pending_size;
 };
 
 struct hap_network_connection {
     void * raw;
     HAPServer * server;
     hap_user_connection * user;
+
+    //Set by the network implementation, unique among open connections
+    //and not reused right away. 0 if the implementation has no ids.
+    uint32_t id;
+};
+
+//A descriptor that the network implementation needs polled, with
+//poll(2) event bits (the same values as epoll's on linux)
+struct hap_network_pollfd {
+    int fd;
+    short events;
+};
+
+//A piece of data to send, see hap_network_sendv()
+struct hap_network_iovec {
+    const uint8_t * data;
+    unsigned int length;
 };
 
 struct hap_sd_txt_item {
@@ -41,11 +41,19 @@
 #include "sha512.h"
 
 #include "srp.h"
-
-static int g_initialized = 0;
-static mbedtls_entropy_context entropy_ctx;
-static mbedtls_ctr_drbg_context ctr_drbg_ctx;
-static mbedtls_mpi *RR;
+#include "../platform.h"
+
+/* Servers of a shard group run on their own threads, each seeds its own generator */
+#ifdef USE_HAP_SHARDS
+#define CSRP_STATE static __thread
+#else
+#define CSRP_STATE static
+#endif
+
+CSRP_STATE int g_initialized = 0;
+CSRP_STATE mbedtls_entropy_context entropy_ctx;
+CSRP_STATE mbedtls_ctr_drbg_context ctr_drbg_ctx;
+CSRP_STATE mbedtls_mpi *RR;
 
 void delete_ng(NGConstant *ng) {
     if (ng) {
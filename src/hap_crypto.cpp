@@ -189,7 +189,7 @@ void _srpInit_genver_substep(void * handle, int ret){
     delete store;
 
     //Next gen public key
-    info->server->emit(HAPEvent::HAPCRYPTO_SRP_INIT_FINISH_GEN_SALT, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_SRP_INIT_FINISH_GEN_SALT>(info);
 }
 
 /**
@@ -284,17 +284,16 @@ void _srpInit_genPub_substep(void * handle, int ret){
     //Free B
     _mpiFree(B);
 
-    info->server->emit(HAPEvent::HAPCRYPTO_SRP_INIT_COMPLETE, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_SRP_INIT_COMPLETE>(info);
     delete store;
 }
 
 /**
  * Generate public key and emits HAPCRYPTO_SRP_INIT_COMPLETE
  *
- * @param event
+ * @param info
  */
-void _srpInit_onGenSalt_thenGenPub(HAPEvent * event){
-    auto info = event->arg<hap_crypto_setup>();
+void _srpInit_onGenSalt_thenGenPub(hap_crypto_setup * info){
     auto ng = _hap_read_ng();
     csrp_init_random();
 
@@ -367,7 +366,7 @@ void hap_crypto_srp_proof(hap_crypto_setup * info) {
     verifier->bytes_B = info->B;
 
     //Next: gen session key
-    info->server->emit(HAPEvent::HAPCRYPTO_SRP_PROOF_VERIFIER_CREATED, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_SRP_PROOF_VERIFIER_CREATED>(info);
 }
 
 void _srpProof_substep2_genSKey(void * handle, int ret){
@@ -392,7 +391,7 @@ void _srpProof_substep2_genSKey(void * handle, int ret){
     delete[] sessionKey;
 
     //Next: M
-    info->server->emit(HAPEvent::HAPCRYPTO_SRP_PROOF_SKEY_GENERATED, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_SRP_PROOF_SKEY_GENERATED>(info);
     delete store;
 }
 
@@ -428,8 +427,7 @@ void _srpProof_substep1_genSKey(void * handle, int ret){
 #endif
 }
 
-void _srpProof_onVerifierCreate_thenGenSKey(HAPEvent * event){
-    auto info = event->arg<hap_crypto_setup>();
+void _srpProof_onVerifierCreate_thenGenSKey(hap_crypto_setup * info){
     auto verifier = static_cast<SRPVerifier *>(info->handle);
 
     auto A = _mpiNew(info->A, info->ALen);
@@ -469,8 +467,7 @@ void _srpProof_onVerifierCreate_thenGenSKey(HAPEvent * event){
 #endif
 }
 
-void _srpProof_onSKey_thenM(HAPEvent * event){
-    auto info = event->arg<hap_crypto_setup>();
+void _srpProof_onSKey_thenM(hap_crypto_setup * info){
     auto verifier = static_cast<SRPVerifier *>(info->handle);
 
     //M = H(H(N) xor H(g), H(I), s, A, B, K)
@@ -527,11 +524,10 @@ void _srpProof_onSKey_thenM(HAPEvent * event){
     delete[] MBytes;
 
     //Next, generate H(A|M|K)
-    info->server->emit(HAPEvent::HAPCRYPTO_SRP_PROOF_SSIDE_GENERATED, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_SRP_PROOF_SSIDE_GENERATED>(info);
 }
 
-void _srpProof_onM_thenAMK(HAPEvent * event){
-    auto info = event->arg<hap_crypto_setup>();
+void _srpProof_onM_thenAMK(hap_crypto_setup * info){
     auto verifier = static_cast<SRPVerifier *>(info->handle);
 
     auto AMKCtx = _sha512InitStart();
@@ -541,41 +537,44 @@ void _srpProof_onM_thenAMK(HAPEvent * event){
     info->serverProof = _sha512FinalFree(AMKCtx);
 
     //Complete M4
-    info->server->emit(HAPEvent::HAPCRYPTO_SRP_PROOF_COMPLETE, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_SRP_PROOF_COMPLETE>(info);
 }
 
-void _chachaPoly_decrypt(HAPEvent * event){
-    auto info = event->arg<hap_crypto_info>();
+void _chachaPoly_decrypt(hap_crypto_info * info){
 
     unsigned char nonce[12];
     memset(nonce, 0, sizeof(nonce));
     memcpy(nonce + 12 - info->nonceLen, info->nonce, info->nonceLen);
 
+    //The tag is checked against the ciphertext as each block is read, before
+    //it is overwritten, so the output may be the input
+    auto inPlace = (info->flags) & CRYPTO_FLAG_IN_PLACE; // NOLINT
     delete[] info->rawData;
-    info->rawData = new uint8_t[info->dataLen];
+    info->rawData = inPlace ? nullptr : new uint8_t[info->dataLen];
+    auto output = inPlace ? info->encryptedData : info->rawData;
 
     auto ctx = new mbedtls_chachapoly_context;
     mbedtls_chachapoly_init(ctx);
     mbedtls_chachapoly_setkey(ctx, info->key);
     auto ret = mbedtls_chachapoly_auth_decrypt(
             ctx, info->dataLen, nonce, info->aad, info->aadLen,
-            info->authTag, info->encryptedData, info->rawData
+            info->authTag, info->encryptedData, output
     );
     mbedtls_chachapoly_free(ctx);
 
     delete ctx;
 
     if(ret == 0){
-        if(!((info->flags) & CRYPTO_FLAG_NO_DELETE)) // NOLINT
+        if(!inPlace && !((info->flags) & CRYPTO_FLAG_NO_DELETE)) // NOLINT
             delete[] info->encryptedData;//Free encrypted data after decrypted
         info->encryptedData = nullptr;
+        info->rawData = output;
     }
 
-    info->server->emit(HAPEvent::HAPCRYPTO_DECRYPTED, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_DECRYPTED>(info);
 }
 
-void _chachaPoly_encrypt(HAPEvent * event){
-    auto info = event->arg<hap_crypto_info>();
+void _chachaPoly_encrypt(hap_crypto_info * info){
 
     unsigned char nonce[12];
     memset(nonce, 0, sizeof(nonce));
@@ -602,27 +601,11 @@ void _chachaPoly_encrypt(HAPEvent * event){
         info->rawData = nullptr;
     }
 
-    info->server->emit(HAPEvent::HAPCRYPTO_ENCRYPTED, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_ENCRYPTED>(info);
 }
 
-void hap_crypto_init(HAPServer * server) {
+void hap_crypto_init(HAPServer *) {
     csrp_init_random();
-
-    //M1
-    server->on(HAPEvent::HAPCRYPTO_SRP_INIT_FINISH_GEN_SALT, _srpInit_onGenSalt_thenGenPub);
-    //M2
-    server->on(HAPEvent::HAPCRYPTO_SRP_PROOF_VERIFIER_CREATED, _srpProof_onVerifierCreate_thenGenSKey);
-    server->on(HAPEvent::HAPCRYPTO_SRP_PROOF_SKEY_GENERATED, _srpProof_onSKey_thenM);
-    server->on(HAPEvent::HAPCRYPTO_SRP_PROOF_SSIDE_GENERATED, _srpProof_onM_thenAMK);
-
-    //Chachapoly decrypt
-    server->on(HAPEvent::HAPCRYPTO_NEED_DECRYPT, _chachaPoly_decrypt);
-    server->on(HAPEvent::HAPCRYPTO_NEED_ENCRYPT, _chachaPoly_encrypt);
-
-#ifdef USE_ASYNC_MATH
-    //Init async math handlers
-    hap_crypto_math_init(server);
-#endif
 }
 
 void hap_crypto_srp_free(hap_crypto_setup * info) {
@@ -637,11 +620,11 @@ bool hap_crypto_verify_client_proof(hap_crypto_setup * info) {
 }
 
 void hap_crypto_data_decrypt(hap_crypto_info * info) {
-    info->server->emit(HAPEvent::HAPCRYPTO_NEED_DECRYPT, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_NEED_DECRYPT>(info);
 }
 
 void hap_crypto_data_encrypt(hap_crypto_info * info) {
-    info->server->emit(HAPEvent::HAPCRYPTO_NEED_ENCRYPT, info);
+    info->server->emit<HAPEvent::HAPCRYPTO_NEED_ENCRYPT>(info);
 }
 
 bool hap_crypto_data_decrypt_did_succeed(hap_crypto_info * info) {
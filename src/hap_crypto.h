@@ -38,11 +38,15 @@ class HAPUserHelper;
 
 #define CRYPTO_FLAG_NETWORK     0b00000001
 #define CRYPTO_FLAG_NO_DELETE   0b00000010
+//Decrypt over encryptedData, which becomes rawData once authenticated
+#define CRYPTO_FLAG_IN_PLACE    0b00000100
 
 struct hap_crypto_info {
     HAPServer * server;
     HAPUserHelper * session;
     hap_network_connection * conn = nullptr;
+    //Id of conn, which may be closed and reused before the data is processed
+    uint32_t connId = 0;
     uint8_t flags = 0;
 
     uint8_t * encryptedData = nullptr;
@@ -53,6 +57,8 @@ struct hap_crypto_info {
     const uint8_t * aad = nullptr;
 
     uint8_t key[HAPCRYPTO_CHACHA_KEYSIZE];
+    //Nonce of a network frame, frames are numbered when they are queued
+    uint8_t frameNonce[8];
 
     unsigned int dataLen = 0;
     unsigned int nonceLen = 0;
@@ -101,11 +107,23 @@ struct hap_crypto_verify {
 };
 
 /**
- * Add crypto yield listeners to server. Called by
+ * Init the random generator used by srp. Called by
  * HAPPairingsManager::HAPPairingsManager()
  */
 void hap_crypto_init(HAPServer *);
 
+/**
+ * Steps of the async functions below, each run when the event emitted
+ * by the previous step is dispatched. HAPServer::_dispatchInternal()
+ * calls them directly instead of going through the listener table.
+ */
+void _srpInit_onGenSalt_thenGenPub(hap_crypto_setup *);
+void _srpProof_onVerifierCreate_thenGenSKey(hap_crypto_setup *);
+void _srpProof_onSKey_thenM(hap_crypto_setup *);
+void _srpProof_onM_thenAMK(hap_crypto_setup *);
+void _chachaPoly_decrypt(hap_crypto_info *);
+void _chachaPoly_encrypt(hap_crypto_info *);
+
 /**
  * Async function
  *
@@ -51,6 +51,14 @@ public:
          */
         HAP_NET_DISCONNECT,
 
+        /**
+         * Triggered when a congested client can take data again while
+         * characteristic events are held back for it.
+         *
+         * Handled internally by HAPServer
+         */
+        HAP_NET_DRAINED,
+
         /**
          * Triggered when the parameters of the server have updated and the
          * mDNS service discovery needs to be updated as well.
@@ -81,6 +89,14 @@ public:
          */
         HAP_CHARACTERISTIC_UPDATE,
 
+        /**
+         * A characteristic value posted from another thread, which is
+         * applied on the event loop.
+         *
+         * Handled internally by HAPServer
+         */
+        HAP_CHARACTERISTIC_POSTED_VALUE,
+
         /**
          * The followings are cryptography yields. Nothing besides
          * HAPPairingsManager and crypto impl should listen to
@@ -103,10 +119,61 @@ public:
 
 #ifdef USE_ASYNC_MATH
         HAPCRYPTO_ASYNC_EXPMOD_BODY,
-        HAPCRYPTO_ASYNC_EXPMOD_FINAL
+        HAPCRYPTO_ASYNC_EXPMOD_FINAL,
 #endif
+
+        /**
+         * Number of event ids, used to size the dispatch table.
+         * Must always be the last one.
+         */
+        EVENT_COUNT
+    };
+
+    /**
+     * Queue lanes, from the highest priority to the lowest. Lanes are
+     * drained by weighted round robin, see HAPServer::setLaneWeight().
+     * HAP_NET_DISCONNECT frees the connection, so it is held back until
+     * the events queued before it in the other lanes are dispatched.
+     */
+    enum Lane {
+        //Connections, requests and characteristic updates
+        LANE_CONTROL = 0,
+
+        //Encryption of the data path and pairing results
+        LANE_CRYPTO,
+
+        //SRP steps, key generation and async math
+        LANE_BACKGROUND,
+
+        LANE_COUNT
     };
 
+    static Lane laneOf(EventID id) {
+        switch (id){
+            case HAPCRYPTO_NEED_ENCRYPT:
+            case HAPCRYPTO_NEED_DECRYPT:
+            case HAPCRYPTO_ENCRYPTED:
+            case HAPCRYPTO_DECRYPTED:
+            case HAP_DEVICE_PAIR:
+            case HAP_DEVICE_VERIFY:
+                return LANE_CRYPTO;
+            case HAP_INITIALIZE_KEYPAIR:
+            case HAPCRYPTO_SRP_INIT_FINISH_GEN_SALT:
+            case HAPCRYPTO_SRP_INIT_COMPLETE:
+            case HAPCRYPTO_SRP_PROOF_VERIFIER_CREATED:
+            case HAPCRYPTO_SRP_PROOF_SKEY_GENERATED:
+            case HAPCRYPTO_SRP_PROOF_SSIDE_GENERATED:
+            case HAPCRYPTO_SRP_PROOF_COMPLETE:
+#ifdef USE_ASYNC_MATH
+            case HAPCRYPTO_ASYNC_EXPMOD_BODY:
+            case HAPCRYPTO_ASYNC_EXPMOD_FINAL:
+#endif
+                return LANE_BACKGROUND;
+            default:
+                return LANE_CONTROL;
+        }
+    }
+
     template<typename T = void *>
     T *arg() { return static_cast<T *>(argument); }
 
@@ -118,25 +185,129 @@ private:
 
     void (*didEmit)(HAPEvent *event) = nullptr;
 
+    //Posted events come from the heap and are not returned to the pool
+    bool pooled = true;
+
+    //Order in which the event was queued, across the lanes
+    uint32_t sequence = 0;
+
+#ifdef USE_EVENT_LOOP_STATS
+    //hap_micros() when emitted, it wraps around but the queueing time is
+    //taken as an unsigned difference, see hap_micros_since()
+    uint32_t emittedAt = 0;
+#endif
+
     HAPEvent *next = nullptr;
 };
 
+class BaseCharacteristic;
+struct HAPPostedValue;
+struct _async_math_expmod_info;
+
+/**
+ * The argument type carried by each event, bound at compile time.
+ * Used by HAPServer::on<>() and HAPServer::emit<>() so that handlers
+ * receive their payload without casting from void *.
+ */
+template<HAPEvent::EventID>
+struct HAPEventPayload { typedef void type; };
+
+#define HAP_EVENT_PAYLOAD(id, T) \
+    template<> struct HAPEventPayload<HAPEvent::id> { typedef T type; };
+
+HAP_EVENT_PAYLOAD(HAP_NET_CONNECT, hap_network_connection)
+HAP_EVENT_PAYLOAD(HAP_NET_RECEIVE_REQUEST, hap_network_connection)
+HAP_EVENT_PAYLOAD(HAP_NET_DISCONNECT, hap_network_connection)
+HAP_EVENT_PAYLOAD(HAP_NET_DRAINED, hap_network_connection)
+HAP_EVENT_PAYLOAD(HAP_DEVICE_PAIR, hap_pair_info)
+HAP_EVENT_PAYLOAD(HAP_DEVICE_VERIFY, hap_pair_info)
+HAP_EVENT_PAYLOAD(HAP_CHARACTERISTIC_UPDATE, BaseCharacteristic)
+HAP_EVENT_PAYLOAD(HAP_CHARACTERISTIC_POSTED_VALUE, HAPPostedValue)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_SRP_INIT_FINISH_GEN_SALT, hap_crypto_setup)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_SRP_INIT_COMPLETE, hap_crypto_setup)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_SRP_PROOF_VERIFIER_CREATED, hap_crypto_setup)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_SRP_PROOF_SKEY_GENERATED, hap_crypto_setup)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_SRP_PROOF_SSIDE_GENERATED, hap_crypto_setup)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_SRP_PROOF_COMPLETE, hap_crypto_setup)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_NEED_ENCRYPT, hap_crypto_info)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_NEED_DECRYPT, hap_crypto_info)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_ENCRYPTED, hap_crypto_info)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_DECRYPTED, hap_crypto_info)
+#ifdef USE_ASYNC_MATH
+HAP_EVENT_PAYLOAD(HAPCRYPTO_ASYNC_EXPMOD_BODY, _async_math_expmod_info)
+HAP_EVENT_PAYLOAD(HAPCRYPTO_ASYNC_EXPMOD_FINAL, _async_math_expmod_info)
+#endif
+
+#undef HAP_EVENT_PAYLOAD
+
+/**
+ * The typed argument of an event, e.g. hap_event_payload<HAPEvent::HAPCRYPTO_DECRYPTED>(event)
+ */
+template<HAPEvent::EventID ID>
+inline typename HAPEventPayload<ID>::type * hap_event_payload(HAPEvent * event){
+    return event->arg<typename HAPEventPayload<ID>::type>();
+}
+
 struct HAPEventListener {
 public:
     typedef void (*Callback)(HAPEvent *);
 
-    typedef void (HAPServer::*HAPCallback)(HAPEvent *);
-
 private:
     friend class HAPServer;
 
     HAPEvent::EventID listening = HAPEvent::DUMMY;
     Callback onEvent = nullptr;
-    HAPCallback _internalOnEvent = nullptr;
+
+    //Set when removed while its event is being dispatched
+    bool detached = false;
 
     HAPEventListener *next = nullptr;
 };
 
+struct HAPEventPoolStats {
+    //Events taken from the pool
+    unsigned long hits = 0;
+
+    //Events that had to be allocated on the heap
+    unsigned long misses = 0;
+
+    //Events owned by the pool, in use or not
+    unsigned int capacity = 0;
+
+    //Events currently free in the pool
+    unsigned int available = 0;
+};
+
+#ifdef USE_EVENT_LOOP_STATS
+/**
+ * Event loop counters, only collected when built with USE_EVENT_LOOP_STATS
+ */
+struct HAPEventLoopStats {
+    SCONST unsigned int HISTOGRAM_BUCKETS = 20;
+
+    //Indexed by HAPEvent::EventID
+    unsigned long emitted[HAPEvent::EVENT_COUNT] = {};
+    unsigned long dispatched[HAPEvent::EVENT_COUNT] = {};
+
+    unsigned int queueDepth = 0;
+    unsigned int queueHighWater = 0;
+
+    //Bucket 0 counts samples of [0, 2) microseconds, bucket n > 0 of
+    //[2^n, 2^(n+1)), the last bucket everything above. Samples are
+    //differences of 32-bit timestamps, which are right across the wrap
+    //around of hap_micros() for anything shorter than ~71 minutes
+
+    //Time an event waited in the queue, from emit() to dispatch
+    unsigned long dispatchLatency[HISTOGRAM_BUCKETS] = {};
+
+    //Time spent in the listeners and completion callback of an event
+    unsigned long handlerTime[HISTOGRAM_BUCKETS] = {};
+
+    //Longest loop iteration in microseconds, not counting the network wait
+    uint32_t longestIteration = 0;
+};
+#endif
+
 struct CharacteristicSubscriber {
 private:
     friend class HAPServer;
@@ -51,7 +51,6 @@ private:
     uint8_t identifier[36];
     uint8_t AccessoryToControllerKey[32];
     uint8_t ControllerToAccessoryKey[32];
-    uint8_t nonceStore[8];
     uint32_t writeCount = 0;
     uint32_t readCount = 0;
 
@@ -28,7 +28,12 @@
 
 class HAPUserHelper {
 public:
-    explicit HAPUserHelper(hap_network_connection * conn);
+    /**
+     * @param request Whether the helper answers the request received on
+     * conn, which is then flushed when the helper is destroyed so the
+     * next pipelined request can be parsed
+     */
+    explicit HAPUserHelper(hap_network_connection * conn, bool request = false);
     ~HAPUserHelper();
 
     //simple arc
@@ -40,6 +45,11 @@ public:
     unsigned int dataLength();
     hap_http_path path();
     hap_http_method method();
+
+    /**
+     * The path as requested, without the query
+     */
+    const char * pathName();
     hap_http_content_type requestContentType();
     hap_pair_info * pairInfo();
     const hap_http_request_parameters * params();
@@ -67,6 +77,29 @@ private:
     friend class HAPServer;
     hap_network_connection * conn;
     unsigned int refCount;
+    bool request;
+};
+
+/**
+ * Answers a request to a route added with HAPServer::route()
+ *
+ * @param request The request, which can be retained to answer later
+ * @param argument The argument given to HAPServer::route()
+ */
+typedef void (*HAPRouteHandler)(HAPUserHelper * request, void * argument);
+
+struct HAPRoute {
+private:
+    friend class HAPServer;
+
+    //path_hash of the requests
+    uint32_t hash = 0;
+    hap_http_method method = METHOD_UNKNOWN;
+    //nullptr for a free slot
+    const char * path = nullptr;
+    HAPRouteHandler handler = nullptr;
+    void * argument = nullptr;
+    bool verified = true;
 };
 
 #endif //HAPD_HAP_REQUEST_HELPER_H
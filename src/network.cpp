@@ -29,8 +29,15 @@
 
 #include <cstring>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 static const char _method_get[] PROGMEM = "GET";
 static const char _method_put[] PROGMEM = "PUT";
 static const char _method_post[] PROGMEM = "POST";
@@ -75,210 +82,468 @@ void hap_event_network_accept(hap_network_connection *server, hap_network_connec
     auto user = new hap_user_connection();
     auto hap = server->server;
     user->request_buffer = nullptr;
-    user->request_header = nullptr;
-    user->response_header = nullptr;
+    user->request_buffer_size = 0;
+    user->request_current_length = 0;
     user->response_buffer = nullptr;
+    user->parse_state = HTTP_PARSE_REQUEST_LINE;
+    user->head_length = 0;
+    user->line_start = 0;
+    user->line_colon = 0;
+    user->pipeline_buffer = nullptr;
+    user->pipeline_length = 0;
+    user->pipeline_size = 0;
     user->frameBuf = nullptr;
+    user->frameSpare = nullptr;
     user->frameBufCurrLen = 0;
     user->frameExpLen = 0;
+    user->frameHeaderLen = 0;
+    user->congested = false;
+    user->pending_events = nullptr;
+    user->pending_count = 0;
+    user->pending_size = 0;
     user->pair_info = new hap_pair_info(hap);
     client->user = user;
     client->server = hap;
-    hap->emit(HAPEvent::HAP_NET_CONNECT, client);
+    hap->emit<HAPEvent::HAP_NET_CONNECT>(client);
 }
 
-void hap_http_parse(hap_network_connection *client, const uint8_t *originalData, unsigned int length){
-    auto user = client->user;
-    auto data = originalData;
+/**
+ * Whether the len bytes at str are the PROGMEM string prog, ignoring case
+ */
+static bool hap_http_token_is(const char * str, unsigned int len, const char * prog){
+    return len == strlen_P(prog) && strncasecmp_P(str, prog, len) == 0;
+}
 
-    if(user->response_header && user->response_header->content_length == user->request_current_length){
-        HAP_DEBUG("Not flushed when new data arrives. Cleaning right now.");
-        //Clean buffer before creating new ones
-        hap_network_flush(client);
-    }
+/**
+ * Case folded FNV-1a of a header name, for matching known names with a
+ * switch. Folding also maps a few punctuation marks together, so a match
+ * is confirmed with hap_http_token_is().
+ */
+static uint32_t hap_http_name_hash(const char * name, unsigned int len){
+    uint32_t hash = 2166136261u;
+    for(unsigned int i = 0; i < len; ++i)
+        hash = (hash ^ (static_cast<uint8_t>(name[i]) | 0x20u)) * 16777619u;
+    return hash;
+}
 
-#define CMP_PROGSTR_PTR(prog) (strncasecmp_P(reinterpret_cast<const char *>(data), prog, strlen_P(prog)) == 0)
+static constexpr uint32_t _hap_http_name_hash(const char * name, uint32_t hash){
+    return *name ? _hap_http_name_hash(name + 1, (hash ^ (static_cast<uint8_t>(*name) | 0x20u)) * 16777619u) : hash;
+}
+
+/**
+ * hap_http_name_hash() of a literal, computed at compile time
+ */
+static constexpr uint32_t hap_http_name_hash(const char * name){
+    return _hap_http_name_hash(name, 2166136261u);
+}
 
-    // If request_header has been not received, it means its time to create a new request!
-    if (user->request_header == nullptr) {
-        //Fail if length is smaller than 125
-        if (length < 60) {
-            HAP_DEBUG("Header length (%u) too short. Ignoring current packet.", length);
-            return;
+/**
+ * First of the bytes a and b in [p, end), or end if there is none.
+ * Like picohttpparser, 16 or 32 bytes are compared at a time where the
+ * target has SIMD, so up to HAP_HTTP_SCAN_PADDING bytes past end are read.
+ * SSE4.2's pcmpestri is left out, two compares are faster for two bytes.
+ */
+static const uint8_t * hap_http_scan(const uint8_t * p, const uint8_t * end, uint8_t a, uint8_t b){
+#if defined(__AVX2__)
+    auto wideA = _mm256_set1_epi8(static_cast<char>(a));
+    auto wideB = _mm256_set1_epi8(static_cast<char>(b));
+    for(; p < end; p += 32){
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        auto found = _mm256_or_si256(_mm256_cmpeq_epi8(v, wideA), _mm256_cmpeq_epi8(v, wideB));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(found));
+        if(mask){
+            auto hit = p + __builtin_ctz(mask);
+            return hit < end ? hit : end;
+        }
+    }
+#elif defined(__SSE2__)
+    auto narrowA = _mm_set1_epi8(static_cast<char>(a));
+    auto narrowB = _mm_set1_epi8(static_cast<char>(b));
+    for(; p < end; p += 16){
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        auto found = _mm_or_si128(_mm_cmpeq_epi8(v, narrowA), _mm_cmpeq_epi8(v, narrowB));
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(found));
+        if(mask){
+            auto hit = p + __builtin_ctz(mask);
+            return hit < end ? hit : end;
+        }
+    }
+#elif defined(__ARM_NEON)
+    auto narrowA = vdupq_n_u8(a);
+    auto narrowB = vdupq_n_u8(b);
+    for(; p < end; p += 16){
+        auto v = vld1q_u8(p);
+        auto found = vorrq_u8(vceqq_u8(v, narrowA), vceqq_u8(v, narrowB));
+        //Narrow every byte of the comparison to a nibble of a 64-bit mask
+        auto nibbles = vshrn_n_u16(vreinterpretq_u16_u8(found), 4);
+        auto mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+        if(mask){
+            auto hit = p + (__builtin_ctzll(mask) >> 2);
+            return hit < end ? hit : end;
         }
+    }
+#else
+    for(; p < end; ++p) if(*p == a || *p == b) return p;
+#endif
+    return end;
+}
 
-        user->request_header = new hap_http_description();
-        user->request_header->content_length = 0;
-        user->request_buffer = nullptr;
+/**
+ * hap_http_scan() within the request line and headers being split in place
+ */
+static char * hap_http_scan(char * p, const char * end, char a, char b){
+    auto begin = reinterpret_cast<const uint8_t *>(p);
+    auto found = hap_http_scan(begin, reinterpret_cast<const uint8_t *>(end), static_cast<uint8_t>(a), static_cast<uint8_t>(b));
+    return p + (found - begin);
+}
 
-        //Initialize response buffers
-        delete user->response_header;
-        user->response_header = new hap_http_description();
-        user->response_buffer = nullptr;
+static bool hap_http_param_enabled(const char * value){
+    return *value == '1' || *value == 't';
+}
 
-        //Parse request method
-        // "GET /accessories HTTP/1.1\r\n"
-
-        if (CMP_PROGSTR_PTR(_method_put)) {
-            user->request_header->method = PUT;
-            data += strlen_P(_method_put) + 1;
-        } else if (CMP_PROGSTR_PTR(_method_get)) {
-            user->request_header->method = GET;
-            data += strlen_P(_method_get) + 1;
-        } else if (CMP_PROGSTR_PTR(_method_post)) {
-            user->request_header->method = POST;
-            data += strlen_P(_method_post) + 1;
-        } else {
-            HAP_DEBUG("Unknown request method. Ignoring current packet.");
-            delete user->request_header;
-            user->request_header = nullptr;
-            return;
+/**
+ * Resolve the method with a single probe. The cases are hashed at compile
+ * time, where a collision would be rejected as a duplicate case.
+ */
+static hap_http_method hap_http_method_of(const char * method, unsigned int length){
+    switch (hap_http_name_hash(method, length)) {
+        case hap_http_name_hash("get"):
+            if(hap_http_token_is(method, length, _method_get)) return GET;
+            break;
+        case hap_http_name_hash("put"):
+            if(hap_http_token_is(method, length, _method_put)) return PUT;
+            break;
+        case hap_http_name_hash("post"):
+            if(hap_http_token_is(method, length, _method_post)) return POST;
+            break;
+        default: break;
+    }
+    return METHOD_UNKNOWN;
+}
+
+/**
+ * Same as hap_http_method_of() for the paths, with the hash of the path
+ */
+static hap_http_path hap_http_path_of_hash(const char * path, unsigned int length, uint32_t hash){
+    switch (hash) {
+        case hap_http_name_hash("/accessories"):
+            if(hap_http_token_is(path, length, _path_accessories)) return ACCESSORIES;
+            break;
+        case hap_http_name_hash("/characteristics"):
+            if(hap_http_token_is(path, length, _path_characteristics)) return CHARACTERISTICS;
+            break;
+        case hap_http_name_hash("/identify"):
+            if(hap_http_token_is(path, length, _path_identify)) return IDENTIFY;
+            break;
+        case hap_http_name_hash("/pair-setup"):
+            if(hap_http_token_is(path, length, _path_pair_setup)) return PAIR_SETUP;
+            break;
+        case hap_http_name_hash("/pair-verify"):
+            if(hap_http_token_is(path, length, _path_pair_verify)) return PAIR_VERIFY;
+            break;
+        case hap_http_name_hash("/pairings"):
+            if(hap_http_token_is(path, length, _path_pairings)) return PAIRINGS;
+            break;
+        default: break;
+    }
+    return PATH_UNKNOWN;
+}
+
+hap_http_path hap_http_path_of(const char * path, unsigned int length) {
+    return hap_http_path_of_hash(path, length, hap_http_name_hash(path, length));
+}
+
+uint32_t hap_http_path_hash(const char * path, unsigned int length) {
+    return hap_http_name_hash(path, length);
+}
+
+/**
+ * Parse "GET /characteristics?id=1.2,1.3&ev=1 HTTP/1.1", which is
+ * split in place so that the id parameter can point into it.
+ */
+static bool hap_http_parse_request_line(hap_http_description * header, char * line, char * lineEnd){
+    auto target = hap_http_scan(line, lineEnd, ' ', ' ');
+    if(target == lineEnd) return false;
+    *target++ = '\0';
+
+    //The path ends at the query or at the version
+    auto pathEnd = hap_http_scan(target, lineEnd, ' ', '?');
+    if(pathEnd == lineEnd) return false;
+    char * query = nullptr;
+    char * queryEnd = nullptr;
+    if(*pathEnd == '?'){
+        query = pathEnd + 1;
+        queryEnd = hap_http_scan(query, lineEnd, ' ', ' ');
+        if(queryEnd == lineEnd) return false;
+        *queryEnd = '\0';
+    }
+    *pathEnd = '\0';
+
+    auto methodLen = static_cast<unsigned int>(target - 1 - line);
+    header->method = hap_http_method_of(line, methodLen);
+    if(header->method == METHOD_UNKNOWN){ HAP_DEBUG("Unknown request method %s", line); }
+
+    auto pathLen = static_cast<unsigned int>(pathEnd - target);
+    header->path_name = target;
+    header->path_hash = hap_http_name_hash(target, pathLen);
+    header->path = hap_http_path_of_hash(target, pathLen, header->path_hash);
+
+    SCONST char _id[] = "id";
+    SCONST char _meta[] = "meta";
+    SCONST char _perms[] = "perms";
+    SCONST char _type[] = "type";
+    SCONST char _ev[] = "ev";
+
+    auto params = &header->parameters;
+    while (query){
+        auto key = query;
+        auto value = hap_http_scan(key, queryEnd, '=', '&');
+        if(*value != '=') {
+            //A key without a value
+            query = *value == '&' ? value + 1 : nullptr;
+            continue;
         }
+        *value++ = '\0';
 
-        //Parse request path
-
-        if (CMP_PROGSTR_PTR(_path_accessories)) {
-            user->request_header->path = ACCESSORIES;
-            data += strlen_P(_path_accessories);
-        } else if (CMP_PROGSTR_PTR(_path_characteristics)) {
-            user->request_header->path = CHARACTERISTICS;
-            data += strlen_P(_path_characteristics);
-        } else if (CMP_PROGSTR_PTR(_path_identify)) {
-            user->request_header->path = IDENTIFY;
-            data += strlen_P(_path_identify);
-        } else if (CMP_PROGSTR_PTR(_path_pair_setup)) {
-            user->request_header->path = PAIR_SETUP;
-            data += strlen_P(_path_pair_setup);
-        } else if (CMP_PROGSTR_PTR(_path_pair_verify)) {
-            user->request_header->path = PAIR_VERIFY;
-            data += strlen_P(_path_pair_verify);
-        } else if (CMP_PROGSTR_PTR(_path_pairings)) {
-            user->request_header->path = PAIRINGS;
-            data += strlen_P(_path_pairings);
-        } else {
-            //TODO: send 404
-            HAP_DEBUG("Unacceptable request path. Ignoring current packet.");
-            delete user->request_header;
-            user->request_header = nullptr;
-            return;
+        auto next = hap_http_scan(value, queryEnd, '&', '&');
+        query = *next == '&' ? next + 1 : nullptr;
+        *next = '\0';
+
+        auto keyLen = static_cast<unsigned int>(value - 1 - key);
+        switch (hap_http_name_hash(key, keyLen)) {
+            case hap_http_name_hash(_id):
+                if(strcasecmp(key, _id) == 0) params->id = value;
+                break;
+            case hap_http_name_hash(_meta):
+                if(strcasecmp(key, _meta) == 0) params->meta = hap_http_param_enabled(value);
+                break;
+            case hap_http_name_hash(_perms):
+                if(strcasecmp(key, _perms) == 0) params->perms = hap_http_param_enabled(value);
+                break;
+            case hap_http_name_hash(_type):
+                if(strcasecmp(key, _type) == 0) params->type = hap_http_param_enabled(value);
+                break;
+            case hap_http_name_hash(_ev):
+                if(strcasecmp(key, _ev) == 0) params->ev = hap_http_param_enabled(value);
+                break;
+            default: HAP_DEBUG("Unidentifiable parameter %s", key);
         }
+    }
+    return true;
+}
 
-        //Parse request parameters
-        if(*data == '?'){
-            auto params = &user->request_header->parameters;
-            while (*data != ' '){
-                SCONST char _id[] = "id";
-                SCONST char _meta[] = "meta";
-                SCONST char _perms[] = "perms";
-                SCONST char _type[] = "type";
-                SCONST char _ev[] = "ev";
-
-                char key[6];
-                memset(key, 0, sizeof(key));
-                const uint8_t * valueStart;
-
-                char * keyPtr = key;
-                while (*(data += 1) != '=') *keyPtr++ = *data;
-                valueStart = ++data;
-                while (*(data += 1) != ' ' && *data != '&');
-
-                if(strcasecmp(key, _id) == 0){
-                    auto buf = new char[data - valueStart + 1];
-                    memset(buf, 0, data - valueStart + 1);
-                    memcpy(buf, valueStart, data - valueStart);
-                    params->id = buf;
-                } else if(strcasecmp(key, _meta) == 0){
-                    params->meta = *valueStart == '1' || *valueStart == 't';
-                } else if(strcasecmp(key, _perms) == 0){
-                    params->perms = *valueStart == '1' || *valueStart == 't';
-                } else if(strcasecmp(key, _type) == 0){
-                    params->type = *valueStart == '1' || *valueStart == 't';
-                } else if(strcasecmp(key, _ev) == 0){
-                    params->ev = *valueStart == '1' || *valueStart == 't';
-                } else {
-                    HAP_DEBUG("Unidentifiable parameter %s", key);
+/**
+ * Parse a "Name: value" header line, split in place like the request line.
+ * The colon was found while the line was received.
+ */
+static bool hap_http_parse_header(hap_http_description * header, char * line, char * colon, char * lineEnd){
+    if(colon == nullptr) return false;
+
+    auto value = colon + 1;
+    while (*value == ' ' || *value == '\t') ++value;
+    while (lineEnd > value && (lineEnd[-1] == ' ' || lineEnd[-1] == '\t')) *--lineEnd = '\0';
+
+    auto nameLen = static_cast<unsigned int>(colon - line);
+    auto valueLen = static_cast<unsigned int>(lineEnd - value);
+    switch (hap_http_name_hash(line, nameLen)) {
+        case hap_http_name_hash("content-length"): {
+            if (!hap_http_token_is(line, nameLen, _header_content_length)) break;
+
+            //Checked digit by digit so that oversized bodies are refused before they arrive
+            if(valueLen == 0) return false;
+            unsigned int length = 0;
+            for(auto c = value; c < lineEnd; ++c){
+                if(*c < '0' || *c > '9') return false;
+                length = length * 10 + (*c - '0');
+                if(length > HAP_HTTP_MAX_BODY){
+                    HAP_DEBUG("Request body exceeds %u bytes.", HAP_HTTP_MAX_BODY);
+                    return false;
                 }
             }
+            header->content_length = length;
+            break;
         }
+        case hap_http_name_hash("content-type"):
+            if (!hap_http_token_is(line, nameLen, _header_content_type)) break;
+
+            //Parameters such as charset may follow the type
+            if (strncasecmp_P(value, _ctype_tlv8, strlen_P(_ctype_tlv8)) == 0)
+                header->content_type = HAP_PAIRING_TLV8;
+            else if (strncasecmp_P(value, _ctype_json, strlen_P(_ctype_json)) == 0)
+                header->content_type = HAP_JSON;
+            else {
+                HAP_DEBUG("unknown content type: %s", value);
+            }
+            break;
+        case hap_http_name_hash("host"):
+            if (hap_http_token_is(line, nameLen, _header_host)) header->host = value;
+            break;
+        default: break;
+    }
+    return true;
+}
 
-        data += 11;//Skip the " HTTP/1.1\r\n"
+/**
+ * Make the connection ready for the next request, keeping the body buffer.
+ */
+static void hap_user_reset_request(hap_user_connection * user){
+    user->request_header = hap_http_description();
+    user->request_current_length = 0;
+    user->parse_state = HTTP_PARSE_REQUEST_LINE;
+    user->head_length = 0;
+    user->line_start = 0;
+    user->line_colon = 0;
+}
 
-        while ((data - originalData) < length) {
-            //End of request_header section
-            if ((data + 1 - originalData) < length && *data == '\r' && *(data + 1) == '\n') {
-                data += 2;//Skip to body
-                break;
+/**
+ * Continue the request being received, up to its end.
+ *
+ * @return Bytes consumed, less than length once the request is complete
+ */
+static unsigned int hap_http_parse_request(hap_network_connection *client, const uint8_t *data, unsigned int length){
+    auto user = client->user;
+    auto start = data;
+    auto end = data + length;
+
+    //Bytes are copied until the blank line ending the headers, which may
+    //arrive in any number of pieces. Only the new bytes need to be scanned,
+    //the colon of a header line is found in the same pass as its end
+    if(user->parse_state == HTTP_PARSE_REQUEST_LINE || user->parse_state == HTTP_PARSE_HEADERS){
+        auto room = HAP_HTTP_MAX_HEADER - user->head_length;
+        auto copyLength = length > room ? room : length;
+        auto head = reinterpret_cast<const uint8_t *>(user->head);
+        auto scan = head + user->head_length;
+        memcpy(user->head + user->head_length, data, copyLength);
+        user->head_length += copyLength;
+        auto scanEnd = head + user->head_length;
+
+        while (user->parse_state != HTTP_PARSE_BODY) {
+            bool needColon = user->parse_state == HTTP_PARSE_HEADERS && user->line_colon == 0;
+            auto found = hap_http_scan(scan, scanEnd, '\n', needColon ? ':' : '\n');
+            if(found == scanEnd) break;
+            scan = found + 1;
+            if(*found == ':'){
+                user->line_colon = static_cast<unsigned int>(found - head);
+                continue;
             }
 
-            auto key = new char[16]();
-            auto value = new char[64]();
+            //The line is terminated in place of its "\r\n"
+            auto line = user->head + user->line_start;
+            auto lineColon = user->line_colon ? user->head + user->line_colon : nullptr;
+            auto lineEnd = user->head + (found - head);
+            if(lineEnd > line && lineEnd[-1] == '\r') --lineEnd;
+            *lineEnd = '\0';
+            user->line_start = static_cast<unsigned int>(scan - head);
+            user->line_colon = 0;
+
+            bool valid = true;
+            if(user->parse_state == HTTP_PARSE_REQUEST_LINE){
+                //Empty lines before a request are ignored
+                if(line != lineEnd){
+                    valid = hap_http_parse_request_line(&user->request_header, line, lineEnd);
+                    user->parse_state = HTTP_PARSE_HEADERS;
+                }
+            } else if(line == lineEnd) {
+                user->parse_state = HTTP_PARSE_BODY;
+            } else { valid = hap_http_parse_header(&user->request_header, line, lineColon, lineEnd); }
+
+            if(!valid){
+                HAP_DEBUG("Malformed request. Closing the connection.");
+                user->parse_state = HTTP_PARSE_FAILED;
+                hap_network_close(client);
+                return length;
+            }
+        }
 
-            auto keyPtr = key;
-            while (*data != ':' && (data - originalData) < length) {
-                *keyPtr = *data;
-                ++keyPtr;
-                ++data;
+        if(user->parse_state != HTTP_PARSE_BODY){
+            if(user->head_length == HAP_HTTP_MAX_HEADER){
+                HAP_DEBUG("Request header exceeds %u bytes. Closing the connection.", HAP_HTTP_MAX_HEADER);
+                user->parse_state = HTTP_PARSE_FAILED;
+                hap_network_close(client);
             }
+            return length;
+        }
 
-            if (*data == ':' && (data - originalData) < length) ++data;
-            if (*data == ' ' && (data - originalData) < length) ++data;
+        //What was copied past the blank line is the body or the next request
+        auto headerLength = user->line_start;
+        data += copyLength - (user->head_length - headerLength);
+        user->head_length = headerLength;
+    }
 
-            auto valPtr = value;
-            while ((data + 1 - originalData) < length && *data != '\r' && *(data + 1) != '\n') {
-                *valPtr = *data;
-                ++valPtr;
-                ++data;
-            }
+    if(user->parse_state != HTTP_PARSE_BODY) return length;
 
-            if (strncasecmp_P(key, _header_content_length, strlen_P(_header_content_length)) == 0) {
-                user->request_header->content_length = static_cast<unsigned int>(atoi(value));
-            } else if (strncasecmp_P(key, _header_content_type, strlen_P(_header_content_type)) == 0) {
-                //parse content types
-                if (strncasecmp_P(value, _ctype_tlv8, strlen_P(_ctype_tlv8)) == 0)
-                    user->request_header->content_type = HAP_PAIRING_TLV8;
-                else if (strncasecmp_P(value, _ctype_json, strlen_P(_ctype_json)) == 0)
-                    user->request_header->content_type = HAP_JSON;
-                else
-                    HAP_DEBUG("unknown content type: %s", value);
-            } else if (strncasecmp_P(key, _header_host, strlen_P(_header_host)) == 0) {
-                auto bufLen = strlen(value) + 1;
-                auto hostBuf = new char[bufLen]();
-                memcpy(hostBuf, value, bufLen);
-                if (user->request_header->host) {
-                    auto previousBuf = user->request_header->host;
-                    delete[] previousBuf;
-                    user->request_header->host = nullptr;
-                }
-                user->request_header->host = hostBuf;
-            }
+    //The body buffer only grows, so requests no larger than the previous ones don't allocate
+    auto contentLength = user->request_header.content_length;
+    if(contentLength > user->request_buffer_size){
+        delete[] user->request_buffer;
+        user->request_buffer = new uint8_t[contentLength];
+        user->request_buffer_size = contentLength;
+    }
 
-            data += 2;//Next line
-            delete[] key;
-            delete[] value;
-        }
+    auto available = static_cast<unsigned int>(end - data);
+    auto needed = contentLength - user->request_current_length;
+    auto copyLength = available > needed ? needed : available;
+    if(copyLength > 0) memcpy(user->request_buffer + user->request_current_length, data, copyLength);
+    user->request_current_length += copyLength;
+
+    //If we have read all the data we need
+    if (user->request_current_length == contentLength) {
+        user->parse_state = HTTP_PARSE_COMPLETE;
+        user->response_header = hap_http_description();
+        user->response_buffer = nullptr;
+        client->server->emit<HAPEvent::HAP_NET_RECEIVE_REQUEST>(client);
     }
+    return static_cast<unsigned int>(data + copyLength - start);
+}
 
-    //Creates content buffer
-    if (user->request_buffer == nullptr) {
-        user->request_buffer = new uint8_t[user->request_header->content_length]();
-        user->request_current_length = 0;
+/**
+ * Keep the bytes that arrived behind a request until it is flushed.
+ */
+static void hap_http_pipeline(hap_network_connection *client, const uint8_t *data, unsigned int length){
+    auto user = client->user;
+    if(length > HAP_HTTP_MAX_PIPELINE - user->pipeline_length){
+        HAP_DEBUG("Pipelined requests exceed %u bytes. Closing the connection.", HAP_HTTP_MAX_PIPELINE);
+        user->parse_state = HTTP_PARSE_FAILED;
+        hap_network_close(client);
+        return;
     }
 
-    //If we have more data, append to the buffer
-    auto available = length - (data - originalData);
-    auto needed = user->request_header->content_length - user->request_current_length;
-    if (available > 0) {
-        auto copyLength = available > needed ? needed : available;
-        memcpy(user->request_buffer + user->request_current_length, data, copyLength);
-        user->request_current_length += copyLength;
+    auto needed = user->pipeline_length + length;
+    if(needed > user->pipeline_size){
+        auto size = user->pipeline_size ? user->pipeline_size : 256u;
+        while (size < needed) size *= 2;
+        if(size > HAP_HTTP_MAX_PIPELINE) size = HAP_HTTP_MAX_PIPELINE;
+        auto buf = new uint8_t[size];
+        if(user->pipeline_length) memcpy(buf, user->pipeline_buffer, user->pipeline_length);
+        delete[] user->pipeline_buffer;
+        user->pipeline_buffer = buf;
+        user->pipeline_size = size;
     }
+    memcpy(user->pipeline_buffer + user->pipeline_length, data, length);
+    user->pipeline_length += length;
+}
 
-    //If we have read all the data we need
-    if (user->request_current_length == user->request_header->content_length) {
-        client->server->emit(HAPEvent::HAP_NET_RECEIVE_REQUEST, client);
+void hap_http_parse(hap_network_connection *client, const uint8_t *data, unsigned int length){
+    auto user = client->user;
+    if(user->parse_state == HTTP_PARSE_FAILED) return;
+
+    //Requests sent before the previous one is answered are handled in order
+    if(user->parse_state == HTTP_PARSE_COMPLETE){
+        hap_http_pipeline(client, data, length);
+        return;
     }
+
+    auto consumed = hap_http_parse_request(client, data, length);
+    if(consumed < length && user->parse_state == HTTP_PARSE_COMPLETE)
+        hap_http_pipeline(client, data + consumed, length - consumed);
 }
 
+//Max length of the encrypted data in a frame
+#define HAP_FRAME_MAX_LENGTH 1024u
+
+//frameHeaderLen of a connection that sent a bad frame
+#define HAP_FRAME_DISCARD 0xff
+
 /**
  * Called when data is received.
  *
@@ -290,14 +555,30 @@ void hap_event_network_receive(hap_network_connection *client, const uint8_t *da
     auto info = user->pair_info;
 
     if(info->paired()) {
-        if(!user->frameBuf){ user->frameBuf = new uint8_t[1024]; }
+        //A bad frame was received, the rest of the stream can't be trusted
+        if(user->frameHeaderLen == HAP_FRAME_DISCARD) return;
 
         while (left > 0){
-            //New frame starts here
-            if(user->frameExpLen == 0){
-                user->frameExpLen = data[0] + (static_cast<unsigned int>(data[1]) * 0xff);
-                left -= 2;
-                data += 2;
+            //New frame starts with its little-endian length
+            if(user->frameBuf == nullptr){
+                user->frameHeader[user->frameHeaderLen++] = *data++;
+                --left;
+                if(user->frameHeaderLen < 2) continue;
+
+                user->frameHeaderLen = 0;
+                user->frameExpLen = user->frameHeader[0] | (static_cast<unsigned int>(user->frameHeader[1]) << 8);
+                if(user->frameExpLen > HAP_FRAME_MAX_LENGTH){
+                    HAP_DEBUG("Frame length (%u) exceeds %u bytes. Ignoring the connection.", user->frameExpLen, HAP_FRAME_MAX_LENGTH);
+                    user->frameHeaderLen = HAP_FRAME_DISCARD;
+                    return;
+                }
+
+                //Data is copied straight into the buffer handed to hap crypto, which
+                //decrypts it there. Only frames in flight at the same time need more
+                //than the spare
+                user->frameBuf = user->frameSpare ? user->frameSpare : new uint8_t[HAP_FRAME_MAX_LENGTH + 16];
+                user->frameSpare = nullptr;
+                user->frameBufCurrLen = 0;
             }
 
             auto need = (user->frameExpLen + 16) - user->frameBufCurrLen;
@@ -308,66 +589,103 @@ void hap_event_network_receive(hap_network_connection *client, const uint8_t *da
             user->frameBufCurrLen += copy;
 
             if(user->frameBufCurrLen == (user->frameExpLen + 16)){
-                //hap crypto will free this buffer when decryption succeed
-                auto buf = new uint8_t[user->frameExpLen + 16];
-                memcpy(buf, user->frameBuf, user->frameExpLen + 16);
-                client->server->onInboundData(client, buf, buf + user->frameExpLen, user->frameExpLen);
-                user->frameExpLen = 0;
+                auto buf = user->frameBuf;
+                auto length = user->frameExpLen;
+                user->frameBuf = nullptr;
                 user->frameBufCurrLen = 0;
+                user->frameExpLen = 0;
+                client->server->onInboundData(client, buf, buf + length, length);
             }
         }
     } else { hap_http_parse(client, data, left); }
 }
 
-static void hap_user_flush(hap_user_connection * user){
-    auto header = user->request_header;
-    if (header) {
-        if (header->host) {
-            delete[] header->host;
-            header->host = nullptr;
-        }
-        if(header->parameters.id){
-            delete[] header->parameters.id;
-            header->parameters.id = nullptr;
-        }
-        user->request_header = nullptr;
-        delete header;
-    }
-    auto buf = user->request_buffer;
-    if (buf) {
-        user->request_buffer = nullptr;
-        user->request_current_length = 0;
-        delete[] buf;
-    }
-    buf = user->frameBuf;
-    if(buf) {
-        user->frameBuf = nullptr;
-        user->frameBufCurrLen = 0;
-        user->frameExpLen = 0;
-        delete[] buf;
+/**
+ * Called when data is received in several buffers.
+ */
+void hap_event_network_receivev(hap_network_connection *client, const hap_network_iovec *iov, unsigned int count) {
+    //Both frames and requests are reassembled across buffers, until a handler
+    //closes the connection
+    for(unsigned int i = 0; i < count && client->raw != nullptr; ++i){
+        hap_event_network_receive(client, iov[i].data, iov[i].length);
     }
 }
 
+/**
+ * Drop the partially received frame. Unlike requests, frames span
+ * across hap_network_flush() so this only happens on disconnection.
+ */
+static void hap_user_free_frame(hap_user_connection * user){
+    delete[] user->frameBuf;
+    delete[] user->frameSpare;
+    user->frameBuf = nullptr;
+    user->frameSpare = nullptr;
+    user->frameBufCurrLen = 0;
+    user->frameExpLen = 0;
+    user->frameHeaderLen = 0;
+}
+
 /**
  * Called when connection is closed.
  */
 void hap_event_network_close(hap_network_connection *client) {
-    auto user = client->user;
     client->server->preDeviceDisconnection(client);
-    client->server->emit(HAPEvent::HAP_NET_DISCONNECT, user, [](HAPEvent * e){
-        auto u = e->arg<hap_user_connection>();
+    //Events queued before this one may still use the connection, so it is only
+    //freed once they are done
+    client->server->emit<HAPEvent::HAP_NET_DISCONNECT>(client, [](HAPEvent * e){
+        auto conn = hap_event_payload<HAPEvent::HAP_NET_DISCONNECT>(e);
+        auto u = conn->user;
         delete u->pair_info;
         u->pair_info = nullptr;
-        hap_user_flush(u);
+        delete[] u->request_buffer;
+        delete[] u->pipeline_buffer;
+        delete[] u->pending_events;
+        hap_user_free_frame(u);
+        delete u;
+        conn->user = nullptr;
+        hap_network_release(conn);
     });
 }
 
+/**
+ * Called when the connection's output crosses a watermark.
+ */
+void hap_event_network_congestion(hap_network_connection *client, bool congested) {
+    HAP_DEBUG("Connection %s", congested ? "congested" : "drained");
+    auto user = client->user;
+    if(user == nullptr) return;
+    user->congested = congested;
+
+    //Implementations may be in the middle of sending, the events held back
+    //are sent from the loop
+    if(!congested && user->pending_count) client->server->emit<HAPEvent::HAP_NET_DRAINED>(client);
+}
+
+/**
+ * Whether the session of the connection is verified.
+ */
+bool hap_network_verified(hap_network_connection *client) {
+    auto user = client->user;
+    return user && user->pair_info && user->pair_info->paired();
+}
+
 /**
  * Flush request
  */
 void hap_network_flush(hap_network_connection *client) {
     auto user = client->user;
-    if (user) { hap_user_flush(user); }
+
+    //A request still being received is left alone
+    if (user == nullptr || user->parse_state != HTTP_PARSE_COMPLETE) return;
+    hap_user_reset_request(user);
+
+    //Start on the next request pipelined behind this one, if any
+    if (user->pipeline_length > 0) {
+        auto consumed = hap_http_parse_request(client, user->pipeline_buffer, user->pipeline_length);
+        if (user->parse_state == HTTP_PARSE_FAILED) return;
+        user->pipeline_length -= consumed;
+        memmove(user->pipeline_buffer, user->pipeline_buffer + consumed, user->pipeline_length);
+    }
 }
 
 void hap_http_encoded_frame_send(hap_network_connection * client, const uint8_t * data, unsigned int size){
@@ -385,7 +703,7 @@ void hap_http_encoded_frame_send(hap_network_connection * client, const uint8_t
 
 void hap_network_response(hap_network_connection *client) {
     auto user = client->user;
-    auto header = user->response_header;
+    auto header = &user->response_header;
     const char *status_ptr, *msg_type_ptr, *ctype_ptr = nullptr;
 
 #define _CASE_STATUS(stat) \
@@ -438,7 +756,7 @@ void hap_network_response(hap_network_connection *client) {
     auto frame_ptr = frame_buf;
 
 #define _NEWCPY(name, ptr) \
-    auto (name) = new char[strlen_P(ptr)](); \
+    auto (name) = new char[strlen_P(ptr) + 1](); \
     strcpy_P(name, ptr);
 
     _NEWCPY(msg_type, msg_type_ptr);
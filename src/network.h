@@ -59,6 +59,28 @@ extern bool hap_network_init_bind(hap_network_connection *, uint16_t port);
  */
 extern bool hap_network_send(hap_network_connection * client, const uint8_t * data, unsigned int length);
 
+/**
+ * Send data gathered from several buffers to a network connection, as
+ * if they were sent in order with hap_network_send()
+ *
+ * Implementations may queue the data until hap_network_send_pending(),
+ * so that everything sent to a connection in an iteration of the loop
+ * goes out together. The buffers can be reused once this returns.
+ *
+ * @param client The connection to send data on
+ * @param iov Buffers to send
+ * @param count Number of buffers
+ * @return If success, return true
+ */
+extern bool hap_network_sendv(hap_network_connection * client, const hap_network_iovec * iov, unsigned int count);
+
+/**
+ * Write out the data queued by hap_network_send() and hap_network_sendv()
+ *
+ * Called by HAPServer once the events of an iteration have been handled.
+ */
+extern void hap_network_send_pending();
+
 /**
  * Close the target connection
  *
@@ -70,10 +92,74 @@ extern bool hap_network_send(hap_network_connection * client, const uint8_t * da
  */
 extern void hap_network_close(hap_network_connection * client);
 
+/**
+ * Let the implementation free or reuse a closed connection
+ *
+ * Called by HAPServer once HAP_NET_DISCONNECT has been handled. Events
+ * queued before the close may refer to the connection until then, so
+ * implementations must keep it in memory and not hand it out again
+ * before this is called.
+ *
+ * @param client A connection passed to hap_event_network_close()
+ */
+extern void hap_network_release(hap_network_connection * client);
+
 /**
  * Polling off events from the network
+ *
+ * @param timeout Max milliseconds to block waiting for network activity,
+ *  0 to return immediately and -1 to wait until something happens
+ */
+extern void hap_network_loop(int timeout = 0);
+
+/**
+ * Interrupt a hap_network_loop() that is blocked waiting for network
+ * activity. Must be safe to call from any thread.
+ *
+ * @param server The listening connection of the loop to wake up, as
+ *  several loops may run on their own threads
+ */
+extern void hap_network_wakeup(hap_network_connection * server);
+
+/**
+ * Get the descriptors to watch when the implementation is driven by
+ * a foreign event loop instead of hap_network_loop(). The set may
+ * change after any call into the implementation.
+ *
+ * @param fds Array to fill
+ * @param max Capacity of fds
+ * @return Number of descriptors, which can be more than max
+ */
+extern unsigned int hap_network_pollfds(hap_network_pollfd * fds, unsigned int max);
+
+/**
+ * Get how long a foreign event loop may wait before calling
+ * hap_network_process(), which can be sooner than any descriptor
+ * becomes ready: edge-triggered descriptors don't signal data that
+ * was left unread for the next turn.
+ *
+ * @param timeout Time the caller is about to wait, -1 for no limit
+ * @return The timeout shortened to the implementation's own deadlines,
+ *  0 if it has work to do right away
+ */
+extern int hap_network_timeout(int timeout);
+
+/**
+ * Handle the readiness of a descriptor returned by hap_network_pollfds()
+ *
+ * @param fd The ready descriptor, or -1 when the wait timed out, to only
+ *  do the work the implementation has pending
+ * @param revents The ready events, with poll(2) event bits
+ */
+extern void hap_network_process(int fd, short revents);
+
+/**
+ * Find an open connection by its id
+ *
+ * @param id hap_network_connection::id
+ * @return nullptr if the connection is closed or the implementation has no ids
  */
-extern void hap_network_loop();
+extern hap_network_connection * hap_network_find(uint32_t id);
 
 /**
  * Init mDNS service discover
@@ -123,6 +209,16 @@ void hap_event_network_accept(hap_network_connection * server, hap_network_conne
  */
 void hap_event_network_receive(hap_network_connection * client, const uint8_t * data, unsigned int length);
 
+/**
+ * Called when data is received in several buffers, such as the segments
+ * of a packet chain, as if each was passed to hap_event_network_receive()
+ * in order.
+ *
+ * @param iov Received buffers
+ * @param count Number of buffers
+ */
+void hap_event_network_receivev(hap_network_connection * client, const hap_network_iovec * iov, unsigned int count);
+
 /**
  * Called when connection is closed.
  *
@@ -131,6 +227,21 @@ void hap_event_network_receive(hap_network_connection * client, const uint8_t *
  */
 void hap_event_network_close(hap_network_connection * client);
 
+/**
+ * Whether the client has completed pair verify, so that network
+ * implementations can evict unverified connections first.
+ */
+bool hap_network_verified(hap_network_connection * client);
+
+/**
+ * Called when the output waiting to be sent on a connection grows past
+ * HAP_NETWORK_OUTPUT_HIGH_WATERMARK, and again when it drains below
+ * HAP_NETWORK_OUTPUT_LOW_WATERMARK.
+ *
+ * @param congested Whether the connection is now congested
+ */
+void hap_event_network_congestion(hap_network_connection * client, bool congested);
+
 /**
  * Delete the current request and response buffers so we can receive more requests
  *
@@ -146,7 +257,26 @@ void hap_network_flush(hap_network_connection * client);
 void hap_network_response(hap_network_connection * client);
 
 /**
- * Parse http data
+ * Get the path hapd knows by its name, PATH_UNKNOWN for others
+ *
+ * @param path Path without the query
+ * @param length Length of the path
+ */
+hap_http_path hap_http_path_of(const char * path, unsigned int length);
+
+/**
+ * Case insensitive hash of a path, as in hap_http_description::path_hash
+ *
+ * @param path Path without the query
+ * @param length Length of the path
+ */
+uint32_t hap_http_path_hash(const char * path, unsigned int length);
+
+/**
+ * Parse http data. Requests may arrive split at any byte, the parser
+ * resumes where the previous call stopped. HAP_NET_RECEIVE_REQUEST is
+ * emitted once the body is complete, and the request stays until
+ * hap_network_flush().
  *
  * @param client
  * @param data
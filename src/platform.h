@@ -54,12 +54,32 @@
 //Use system printf for HAP_DEBUG
 #define USE_PRINTF
 
-//Use BSD style socket for network
+//Use BSD style socket for network, build with -DUSE_HAP_LOOPBACK to
+//replace them with in-memory connections, see platform/loopback_network.h,
+//or with -DUSE_HAP_LWIP to run on lwip, e.g. its unix port
+#if !defined(USE_HAP_LOOPBACK) && !defined(USE_HAP_LWIP)
 #define USE_HAP_NATIVE_SOCKET
+#endif
+
+//Use epoll instead of poll() to wait on the sockets, build with
+//-DUSE_HAP_POLL to keep using poll()
+#if defined(__linux__) && !defined(USE_HAP_POLL) && !defined(USE_HAP_EPOLL)
+#define USE_HAP_EPOLL
+#endif
+
+//Build with -DUSE_HAP_IO_URING and link liburing to drive the sockets with
+//io_uring, the above is still used when the kernel doesn't support it
 
 //Use fs to store persistent information
 #define USE_ANSIC_FD_PERSISTENT
 
+//HAPServer::post() can be called from other threads
+#define USE_ATOMIC_MAILBOX
+
+//Build with -DUSE_HAP_SHARDS for HAPServer::addShard(), which runs servers on
+//several threads, each with its own sockets. It makes every server listen with
+//SO_REUSEPORT, see HAP_SOCK_REUSEPORT
+
 //Disable pgmspace
 #define NATIVE_STRINGS
 
@@ -35,6 +35,8 @@
 #include "../network.h"
 
 #include <cerrno>
+#include <cstddef>
+#include <cstring>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
@@ -42,7 +44,31 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <vector>
+#include <algorithm>
+
+#ifdef USE_HAP_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef USE_HAP_IO_URING
+#include <liburing.h>
+#endif
+
+//Writing to a connection reset by the client must not raise SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define HAP_BSD_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define HAP_BSD_SEND_FLAGS 0
+#endif
+
+//Every thread running a HAPServer has its own sockets, see HAPServer::addShard()
+#ifdef USE_HAP_SHARDS
+#define HAP_BSD_LOCAL static thread_local
+#else
+#define HAP_BSD_LOCAL static
+#endif
 
 #define HAP_BSD_ERRLOG(f) HAP_DEBUG(f "(%d): %s", errno, strerror(errno))
 #define N_RET(ee, f, ret) \
@@ -53,36 +79,547 @@
 
 using namespace std;
 struct _hap_bsdsock {
-    pollfd pfd;
-    enum _hap_bsdsock_type { LISTENING_FD, CLIENT_FD } type;
+    enum _hap_bsdsock_type { LISTENING_FD, CLIENT_FD, WAKEUP_FD } type;
+    int fd;
     hap_network_connection * conn;
     sockaddr_in addr;
-    int& fd;
 
-    _hap_bsdsock(int _fd, _hap_bsdsock_type type, hap_network_connection * conn, sockaddr_in addr = {}):
-            pfd { .fd = _fd, .events = POLLIN, .revents = 0 },
-            type(type), conn(conn), fd(pfd.fd), addr(addr) {}
+    //Slot id, see _hap_bsd_alloc()
+    uint32_t id;
+
+    //Listening sockets: write end of the wakeup pipe of their thread
+    int wakeFd;
+
+    //Set by hap_network_close(), the socket is freed by _hap_bsd_sweep()
+    bool closed;
+
+    //Client sockets: HAPServer is done with the connection, see hap_network_release().
+    //Until then the slot is kept by _hap_bsd_sweep() and marked swept instead
+    bool released;
+    bool swept;
+
+    //Data waiting for hap_network_send_pending()
+    uint8_t * outBuf;
+    unsigned int outLen;
+    unsigned int outCap;
+    bool outQueued;
+
+    //The socket is full and output waits until it becomes writable
+    bool outWaiting;
+
+    //Used up its read budget, see _hap_bsd_serve_deferred()
+    bool readDeferred;
+
+    //Over the high watermark, until drained below the low watermark
+    bool outCongested;
+
+    //Client sockets: position in their idle list, see _hap_bsd_touch()
+    _hap_bsdsock * idlePrev;
+    _hap_bsdsock * idleNext;
+    uint32_t lastActive;
+    bool verified;
+
+#ifndef USE_HAP_EPOLL
+    //Position in _pfds
+    unsigned int pollIndex;
+#endif
+
+#ifdef USE_HAP_IO_URING
+    //Requests on the ring referring to the socket, it is not freed before they complete
+    unsigned int uringOps;
+
+    //Output handed to the ring, left untouched until its send completes
+    uint8_t * sendBuf;
+    unsigned int sendLen;
+    unsigned int sendOff;
+    unsigned int sendCap;
+#endif
 };
-static auto _conn_pool = vector<_hap_bsdsock*>();
+
+/**
+ * Sockets are kept in a generational slot table. Slots are allocated in
+ * chunks so their addresses stay valid while the table grows, which lets
+ * epoll and hap_network_connection::raw point into it. Client connections
+ * are stored in the same slot as their socket.
+ *
+ * A slot id is (generation << 16) | (index + 1), so 0 is never valid and
+ * an id is not reused until its slot has been recycled 65536 times.
+ */
+#define HAP_BSD_SLOT_CHUNK 32
+
+#ifndef HAP_BSD_RECV_BUFFER
+#define HAP_BSD_RECV_BUFFER 4096
+#endif
+
+struct _hap_bsdslot {
+    _hap_bsdsock sock;
+    hap_network_connection conn;
+    uint16_t generation;
+
+    //Index + 1 of the next free slot, 0 for the end of the list
+    uint32_t nextFree;
+};
+
+HAP_BSD_LOCAL auto _slot_chunks = vector<_hap_bsdslot*>();
+HAP_BSD_LOCAL uint32_t _slot_free = 0;
+
+#ifdef USE_HAP_EPOLL
+//Ready events carry their _hap_bsdsock, so there is nothing to scan
+HAP_BSD_LOCAL int _epoll_fd = -1;
+#else
+//Passed to poll() as is, entries are swapped with the last one on removal
+HAP_BSD_LOCAL auto _pfds = vector<pollfd>();
+HAP_BSD_LOCAL auto _pfd_socks = vector<_hap_bsdsock*>();
+#endif
+
+//Closed sockets may still have events pending in the current batch
+HAP_BSD_LOCAL auto _closed_pool = vector<_hap_bsdsock*>();
+
+//Sockets with queued output
+HAP_BSD_LOCAL auto _output_pool = vector<_hap_bsdsock*>();
+
+//Sockets that used up their read budget, and those being served again
+HAP_BSD_LOCAL auto _deferred_pool = vector<_hap_bsdsock*>();
+HAP_BSD_LOCAL auto _deferred_serving = vector<_hap_bsdsock*>();
+
+/**
+ * Open client sockets are kept in two lists ordered by their last
+ * activity, so the idle ones are at the heads. A connection is moved
+ * to the verified list on its first activity after pair verify.
+ */
+struct _hap_bsd_idle_list {
+    _hap_bsdsock * head;
+    _hap_bsdsock * tail;
+};
+
+HAP_BSD_LOCAL _hap_bsd_idle_list _idle_unverified {};
+HAP_BSD_LOCAL _hap_bsd_idle_list _idle_verified {};
+HAP_BSD_LOCAL unsigned int _client_count = 0;
+
+static inline _hap_bsdslot * _hap_bsd_slot(uint32_t index){
+    return &_slot_chunks[index / HAP_BSD_SLOT_CHUNK][index % HAP_BSD_SLOT_CHUNK];
+}
+
+static _hap_bsdsock * _hap_bsd_alloc(int fd, _hap_bsdsock::_hap_bsdsock_type type, hap_network_connection * conn, sockaddr_in addr = {}){
+    if(_slot_free == 0){
+        auto base = static_cast<uint32_t>(_slot_chunks.size() * HAP_BSD_SLOT_CHUNK);
+        if(base + HAP_BSD_SLOT_CHUNK > 0xffff) return nullptr;
+
+        //Thread the new chunk onto the free list
+        auto chunk = new _hap_bsdslot[HAP_BSD_SLOT_CHUNK]();
+        for(uint32_t i = 0; i < HAP_BSD_SLOT_CHUNK; ++i){
+            chunk[i].nextFree = i + 1 < HAP_BSD_SLOT_CHUNK ? base + i + 2 : 0;
+        }
+        _slot_chunks.push_back(chunk);
+        _slot_free = base + 1;
+    }
+
+    auto index = _slot_free - 1;
+    auto slot = _hap_bsd_slot(index);
+    _slot_free = slot->nextFree;
+    slot->nextFree = 0;
+
+    auto sock = &slot->sock;
+    sock->type = type;
+    sock->fd = fd;
+    sock->conn = conn;
+    sock->addr = addr;
+    sock->id = (static_cast<uint32_t>(slot->generation) << 16) | (index + 1);
+    sock->closed = false;
+    sock->released = false;
+    sock->swept = false;
+    sock->wakeFd = -1;
+    sock->outLen = 0;
+    sock->outQueued = false;
+    sock->outWaiting = false;
+    sock->outCongested = false;
+    sock->readDeferred = false;
+    sock->idlePrev = nullptr;
+    sock->idleNext = nullptr;
+    sock->verified = false;
+#ifdef USE_HAP_IO_URING
+    sock->uringOps = 0;
+    sock->sendLen = 0;
+    sock->sendOff = 0;
+#endif
+    return sock;
+}
+
+static void _hap_bsd_free(_hap_bsdsock * sock){
+    auto index = (sock->id & 0xffff) - 1;
+    auto slot = _hap_bsd_slot(index);
+    ++slot->generation;
+    delete[] sock->outBuf;
+    sock->outBuf = nullptr;
+    sock->outCap = 0;
+#ifdef USE_HAP_IO_URING
+    delete[] sock->sendBuf;
+    sock->sendBuf = nullptr;
+    sock->sendCap = 0;
+#endif
+    sock->id = 0;
+    slot->nextFree = _slot_free;
+    _slot_free = index + 1;
+}
+
+/**
+ * The connection stored in the slot of a client socket
+ */
+static inline hap_network_connection * _hap_bsd_slot_conn(_hap_bsdsock * sock){
+    return &_hap_bsd_slot((sock->id & 0xffff) - 1)->conn;
+}
+
+static void _hap_bsd_idle_unlink(_hap_bsdsock * sock){
+    auto& list = sock->verified ? _idle_verified : _idle_unverified;
+    if(!sock->idlePrev && list.head != sock) return;
+    (sock->idlePrev ? sock->idlePrev->idleNext : list.head) = sock->idleNext;
+    (sock->idleNext ? sock->idleNext->idlePrev : list.tail) = sock->idlePrev;
+    sock->idlePrev = nullptr;
+    sock->idleNext = nullptr;
+}
+
+/**
+ * Record activity on a client socket, moving it to the tail of its idle list
+ */
+static void _hap_bsd_touch(_hap_bsdsock * sock){
+    _hap_bsd_idle_unlink(sock);
+    sock->lastActive = hap_millis();
+    sock->verified = hap_network_verified(sock->conn);
+
+    auto& list = sock->verified ? _idle_verified : _idle_unverified;
+    sock->idlePrev = list.tail;
+    (list.tail ? list.tail->idleNext : list.head) = sock;
+    list.tail = sock;
+}
+
+#if HAP_NETWORK_MAX_CONNECTIONS > 0
+/**
+ * The connection to evict when HAP_NETWORK_MAX_CONNECTIONS is reached:
+ * the least recently active unverified one, if any
+ */
+static _hap_bsdsock * _hap_bsd_evictable(){
+    while (auto sock = _idle_unverified.head){
+        if(!hap_network_verified(sock->conn)) return sock;
+        //Verified since its last activity
+        _hap_bsd_touch(sock);
+    }
+    return _idle_verified.head;
+}
+#endif
+
+/**
+ * Close the connections of the list idle for longer than the timeout
+ *
+ * @return The timeout shortened to the next expiry
+ */
+static int _hap_bsd_reap_list(_hap_bsd_idle_list& list, uint32_t idleTimeout, uint32_t now, int timeout){
+    if(idleTimeout == 0) return timeout;
+    while (auto sock = list.head){
+        auto idle = now - sock->lastActive;
+        if(idle < idleTimeout){
+            auto remaining = static_cast<int>(idleTimeout - idle);
+            return (timeout < 0 || remaining < timeout) ? remaining : timeout;
+        }
+        if(!sock->verified && hap_network_verified(sock->conn)){
+            _hap_bsd_touch(sock);
+            continue;
+        }
+        HAP_DEBUG("Closing connection idle for %u ms", idle);
+        hap_network_close(sock->conn);
+    }
+    return timeout;
+}
+
+/**
+ * Close idle connections
+ *
+ * @param timeout Time the caller is about to wait, -1 for no limit
+ * @return The timeout shortened so that the next idle connection is closed on time
+ */
+static int _hap_bsd_reap(int timeout){
+    if(_client_count == 0) return timeout;
+    auto now = hap_millis();
+    timeout = _hap_bsd_reap_list(_idle_unverified, HAP_NETWORK_UNVERIFIED_TIMEOUT, now, timeout);
+    return _hap_bsd_reap_list(_idle_verified, HAP_NETWORK_IDLE_TIMEOUT, now, timeout);
+}
+
+/**
+ * Output not yet taken by the socket
+ */
+static inline unsigned int _hap_bsd_queued(_hap_bsdsock * sock){
+#ifdef USE_HAP_IO_URING
+    return sock->outLen + (sock->sendLen - sock->sendOff);
+#else
+    return sock->outLen;
+#endif
+}
+
+/**
+ * Report the end of congestion once the output drained below the low watermark
+ */
+static void _hap_bsd_drained(_hap_bsdsock * sock){
+    if(sock->outCongested && _hap_bsd_queued(sock) <= HAP_NETWORK_OUTPUT_LOW_WATERMARK){
+        sock->outCongested = false;
+        hap_event_network_congestion(sock->conn, false);
+    }
+}
+
+#ifdef USE_HAP_IO_URING
+/**
+ * With USE_HAP_IO_URING the sockets are driven by an io_uring when the kernel
+ * supports it, and by the epoll or poll() backend otherwise:
+ *
+ * - the listening socket has a multishot accept armed
+ * - clients have a multishot receive picking buffers from a provided buffer ring
+ * - output is sent by the ring, so a single io_uring_enter() submits the sends
+ *   of every connection along with the requests re-armed in the iteration
+ *
+ * Sockets are left blocking, the ring would otherwise complete requests on
+ * them with -EAGAIN instead of waiting.
+ */
+#ifndef HAP_URING_ENTRIES
+#define HAP_URING_ENTRIES 256
+#endif
+
+//Number of provided receive buffers, a power of 2
+#ifndef HAP_URING_BUFFERS
+#define HAP_URING_BUFFERS 64
+#endif
+
+#define HAP_URING_BUFFER_GROUP 0
+
+//Stored in the low bits of a request's user data, next to its _hap_bsdsock
+enum _hap_uring_op { URING_ACCEPT, URING_RECV, URING_SEND, URING_POLL };
+#define HAP_URING_OP_MASK 3u
+
+HAP_BSD_LOCAL io_uring _uring {};
+HAP_BSD_LOCAL bool _uring_enabled = false;
+HAP_BSD_LOCAL io_uring_buf_ring * _uring_bufs = nullptr;
+HAP_BSD_LOCAL uint8_t * _uring_buf_mem = nullptr;
+
+static bool _hap_bsd_uring_init(){
+    auto ret = io_uring_queue_init(HAP_URING_ENTRIES, &_uring, 0);
+    if(ret < 0){
+        HAP_DEBUG("io_uring_queue_init(%d): %s, using the fallback backend", -ret, strerror(-ret));
+        return false;
+    }
+
+    //Needs Linux 5.19, as do multishot accept and receive
+    _uring_bufs = io_uring_setup_buf_ring(&_uring, HAP_URING_BUFFERS, HAP_URING_BUFFER_GROUP, 0, &ret);
+    if(_uring_bufs == nullptr){
+        HAP_DEBUG("io_uring_setup_buf_ring(%d): %s, using the fallback backend", -ret, strerror(-ret));
+        io_uring_queue_exit(&_uring);
+        return false;
+    }
+
+    _uring_buf_mem = new uint8_t[HAP_URING_BUFFERS * HAP_BSD_RECV_BUFFER];
+    for(unsigned int i = 0; i < HAP_URING_BUFFERS; ++i){
+        io_uring_buf_ring_add(_uring_bufs, _uring_buf_mem + i * HAP_BSD_RECV_BUFFER, HAP_BSD_RECV_BUFFER,
+                static_cast<unsigned short>(i), io_uring_buf_ring_mask(HAP_URING_BUFFERS), static_cast<int>(i));
+    }
+    io_uring_buf_ring_advance(_uring_bufs, HAP_URING_BUFFERS);
+    _uring_enabled = true;
+    return true;
+}
+
+static inline uint64_t _hap_bsd_uring_data(_hap_bsdsock * sock, _hap_uring_op op){
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(sock)) | op;
+}
+
+/**
+ * Get a submission entry for a request on the socket, counted until its last completion
+ *
+ * Requests without a socket have their completion ignored
+ */
+static io_uring_sqe * _hap_bsd_uring_sqe(_hap_bsdsock * sock, _hap_uring_op op){
+    auto sqe = io_uring_get_sqe(&_uring);
+    if(sqe == nullptr){
+        //The submission queue is full, hand it to the kernel
+        io_uring_submit(&_uring);
+        sqe = io_uring_get_sqe(&_uring);
+    }
+    io_uring_sqe_set_data64(sqe, sock ? _hap_bsd_uring_data(sock, op) : 0);
+    if(sock) ++sock->uringOps;
+    return sqe;
+}
+
+/**
+ * The multishot request armed for the socket
+ */
+static inline _hap_uring_op _hap_bsd_uring_armed(_hap_bsdsock * sock){
+    switch (sock->type) {
+        case _hap_bsdsock::LISTENING_FD: return URING_ACCEPT;
+        case _hap_bsdsock::CLIENT_FD: return URING_RECV;
+        default: return URING_POLL;
+    }
+}
+
+static void _hap_bsd_uring_arm(_hap_bsdsock * sock){
+    auto op = _hap_bsd_uring_armed(sock);
+    auto sqe = _hap_bsd_uring_sqe(sock, op);
+    if(op == URING_ACCEPT){
+        io_uring_prep_multishot_accept(sqe, sock->fd, nullptr, nullptr, SOCK_CLOEXEC);
+    } else if(op == URING_RECV){
+        io_uring_prep_recv_multishot(sqe, sock->fd, nullptr, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = HAP_URING_BUFFER_GROUP;
+    } else {
+        io_uring_prep_poll_multishot(sqe, sock->fd, POLLIN);
+    }
+}
+
+static void _hap_bsd_uring_send_remaining(_hap_bsdsock * sock){
+    auto sqe = _hap_bsd_uring_sqe(sock, URING_SEND);
+    io_uring_prep_send(sqe, sock->fd, sock->sendBuf + sock->sendOff, sock->sendLen - sock->sendOff, HAP_BSD_SEND_FLAGS);
+}
+
+/**
+ * Hand the queued output to the ring
+ *
+ * One send is in flight at a time to keep the stream in order, the output
+ * queued meanwhile is sent when it completes.
+ */
+static void _hap_bsd_uring_send(_hap_bsdsock * sock){
+    if(sock->sendLen > 0 || sock->outLen == 0) return;
+    swap(sock->outBuf, sock->sendBuf);
+    swap(sock->outCap, sock->sendCap);
+    sock->sendLen = sock->outLen;
+    sock->sendOff = 0;
+    sock->outLen = 0;
+    _hap_bsd_uring_send_remaining(sock);
+}
+#endif
+
+static bool _hap_bsd_poller_init(){
+#ifdef USE_HAP_IO_URING
+    if(_uring_enabled || _hap_bsd_uring_init()) return true;
+#endif
+#ifdef USE_HAP_EPOLL
+    if(_epoll_fd >= 0) return true;
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    N_RET(_epoll_fd, "epoll_create1", false);
+#endif
+    return true;
+}
+
+/**
+ * Start watching the socket for incoming data
+ */
+static void _hap_bsd_watch(_hap_bsdsock * sock){
+#ifdef USE_HAP_IO_URING
+    if(_uring_enabled){
+        _hap_bsd_uring_arm(sock);
+        return;
+    }
+#endif
+#ifdef USE_HAP_EPOLL
+    //Edge-triggered: every handler reads until EAGAIN, and EPOLLOUT
+    //only fires when a full socket becomes writable again
+    epoll_event ev {};
+    ev.events = EPOLLIN | EPOLLET;
+    if(sock->type == _hap_bsdsock::CLIENT_FD) ev.events |= EPOLLRDHUP | EPOLLOUT;
+    ev.data.ptr = sock;
+    N_RET(epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, sock->fd, &ev), "epoll_ctl", HAP_NOTHING);
+#else
+    pollfd pfd {};
+    pfd.fd = sock->fd;
+    pfd.events = POLLIN;
+    sock->pollIndex = static_cast<unsigned int>(_pfds.size());
+    _pfds.push_back(pfd);
+    _pfd_socks.push_back(sock);
+#endif
+}
+
+static void _hap_bsd_unwatch(_hap_bsdsock * sock){
+#ifdef USE_HAP_IO_URING
+    if(_uring_enabled){
+        //Submitted right away, the request's fd may be reused once closed
+        auto sqe = _hap_bsd_uring_sqe(nullptr, URING_ACCEPT);
+        io_uring_prep_cancel64(sqe, _hap_bsd_uring_data(sock, _hap_bsd_uring_armed(sock)), 0);
+        io_uring_submit(&_uring);
+        return;
+    }
+#endif
+#ifdef USE_HAP_EPOLL
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, sock->fd, nullptr);
+#else
+    auto last = _pfd_socks.back();
+    _pfds[sock->pollIndex] = _pfds.back();
+    _pfd_socks[sock->pollIndex] = last;
+    last->pollIndex = sock->pollIndex;
+    _pfds.pop_back();
+    _pfd_socks.pop_back();
+#endif
+}
+
+/**
+ * Wait for the socket to become writable, or stop waiting
+ */
+static void _hap_bsd_wait_writable(_hap_bsdsock * sock, bool wait){
+    sock->outWaiting = wait;
+#ifndef USE_HAP_EPOLL
+    auto& events = _pfds[sock->pollIndex].events;
+    events = static_cast<short>(wait ? (events | POLLOUT) : (events & ~POLLOUT));
+#endif
+}
+
+/**
+ * Free the sockets closed since the last sweep
+ */
+static void _hap_bsd_sweep(){
+    if(_closed_pool.empty()) return;
+    size_t kept = 0;
+    for(auto sock : _closed_pool){
+#ifdef USE_HAP_IO_URING
+        if(_uring_enabled){
+            //Requests still on the ring refer to the socket
+            if(sock->uringOps > 0) _closed_pool[kept++] = sock;
+            else if(sock->type == _hap_bsdsock::CLIENT_FD && !sock->released) sock->swept = true;
+            else _hap_bsd_free(sock);
+            continue;
+        }
+#endif
+#ifndef USE_HAP_EPOLL
+        _hap_bsd_unwatch(sock);
+#endif
+        //The connection in the slot of a client waits for hap_network_release()
+        if(sock->type == _hap_bsdsock::CLIENT_FD && !sock->released) sock->swept = true;
+        else _hap_bsd_free(sock);
+    }
+    _closed_pool.resize(kept);
+}
+
+//Self-pipe used by hap_network_wakeup() to interrupt poll()
+HAP_BSD_LOCAL int _wakeup_pipe[2] = { -1, -1 };
+
+static void _hap_bsd_wakeup_init(){
+    if(_wakeup_pipe[0] >= 0) return;
+    N_RET(pipe(_wakeup_pipe), "pipe", HAP_NOTHING);
+    fcntl(_wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+    _hap_bsd_watch(_hap_bsd_alloc(_wakeup_pipe[0], _hap_bsdsock::WAKEUP_FD, nullptr));
+}
 
 bool hap_network_init_bind(hap_network_connection * conn, uint16_t port){
     int server_fd;
-    sockaddr_in server_addr {
-            .sin_family = AF_INET,
-            .sin_port = htons(port), // NOLINT
-            .sin_addr.s_addr = htonl(INADDR_ANY) // NOLINT
-    };
+    if(!_hap_bsd_poller_init()) return false;
+
+    sockaddr_in server_addr {};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port); // NOLINT
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY); // NOLINT
 
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     N_RET(server_fd, "socket", false);
-    auto hap_fdstore = new _hap_bsdsock(
-            server_fd,
-            _hap_bsdsock::LISTENING_FD,
-            conn);
 
     auto opt_v = 1; //enable reuseaddr
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_v, sizeof(opt_v));
 
+#if HAP_SOCK_REUSEPORT && defined(SO_REUSEPORT)
+    //Let the kernel spread the connections among the shards listening on the port
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt_v, sizeof(opt_v));
+#endif
+
     opt_v = HAP_SOCK_TCP_NODELAY;
     setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &opt_v, sizeof(opt_v));
 
@@ -92,59 +629,231 @@ bool hap_network_init_bind(hap_network_connection * conn, uint16_t port){
     eno = listen(server_fd, 64);
     N_RET(eno, "listen", false);
 
+#ifdef USE_HAP_IO_URING
+    if(!_uring_enabled)
+#endif
     fcntl(server_fd, F_SETFL, O_NONBLOCK);
-    _conn_pool.push_back(hap_fdstore);
+    auto hap_fdstore = _hap_bsd_alloc(server_fd, _hap_bsdsock::LISTENING_FD, conn);
+    _hap_bsd_watch(hap_fdstore);
     conn->raw = hap_fdstore;
+    conn->id = hap_fdstore->id;
+    _hap_bsd_wakeup_init();
+    hap_fdstore->wakeFd = _wakeup_pipe[1];
     return true;
 }
 
 bool hap_network_send(hap_network_connection * client, const uint8_t * data, unsigned int length){
+    hap_network_iovec iov { data, length };
+    return hap_network_sendv(client, &iov, 1);
+}
+
+bool hap_network_sendv(hap_network_connection * client, const hap_network_iovec * iov, unsigned int count){
     if(client->raw == nullptr) return false;
-    HAP_DEBUG("Sending %d raw bytes", length);
-    auto client_fd = static_cast<_hap_bsdsock*>(client->raw);
-    auto eno = send(client_fd->fd, data, length, 0);
-    N_RET(eno, "send", false);
+    auto sock = static_cast<_hap_bsdsock*>(client->raw);
+
+    unsigned int length = 0;
+    for(unsigned int i = 0; i < count; ++i) length += iov[i].length;
+    HAP_DEBUG("Queueing %u raw bytes", length);
+
+    //The client stopped reading, don't let its output grow without bound
+    if(_hap_bsd_queued(sock) + length > HAP_NETWORK_OUTPUT_LIMIT){
+        HAP_DEBUG("Output limit reached with %u bytes queued", _hap_bsd_queued(sock));
+        hap_network_close(client);
+        return false;
+    }
+
+    //Gather into the connection's output buffer
+    if(sock->outLen + length > sock->outCap){
+        auto capacity = sock->outCap ? sock->outCap : 1024u;
+        while (capacity < sock->outLen + length) capacity *= 2;
+        auto buf = new uint8_t[capacity];
+        if(sock->outLen) memcpy(buf, sock->outBuf, sock->outLen);
+        delete[] sock->outBuf;
+        sock->outBuf = buf;
+        sock->outCap = capacity;
+    }
+    for(unsigned int i = 0; i < count; ++i){
+        memcpy(sock->outBuf + sock->outLen, iov[i].data, iov[i].length);
+        sock->outLen += iov[i].length;
+    }
+
+    if(!sock->outCongested && _hap_bsd_queued(sock) >= HAP_NETWORK_OUTPUT_HIGH_WATERMARK){
+        sock->outCongested = true;
+        hap_event_network_congestion(client, true);
+    }
+
+    //A full socket is written once it becomes writable
+    if(!sock->outQueued && !sock->outWaiting){
+        sock->outQueued = true;
+        _output_pool.push_back(sock);
+    }
     return true;
 }
 
+/**
+ * Write as much of the queued output as the socket takes
+ *
+ * @return false if the socket failed
+ */
+static bool _hap_bsd_write(_hap_bsdsock * sock){
+#ifdef USE_HAP_IO_URING
+    if(_uring_enabled){
+        _hap_bsd_uring_send(sock);
+        return true;
+    }
+#endif
+    unsigned int sent = 0;
+    while (sent < sock->outLen){
+        auto written = send(sock->fd, sock->outBuf + sent, sock->outLen - sent, HAP_BSD_SEND_FLAGS);
+        if(written >= 0){
+            sent += static_cast<unsigned int>(written);
+            continue;
+        }
+        if(errno == EINTR) continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+        HAP_BSD_ERRLOG("send");
+        sock->outLen = 0;
+        return false;
+    }
+
+    //Keep what the socket didn't take until it becomes writable
+    sock->outLen -= sent;
+    if(sock->outLen) memmove(sock->outBuf, sock->outBuf + sent, sock->outLen);
+    if((sock->outLen > 0) != sock->outWaiting) _hap_bsd_wait_writable(sock, sock->outLen > 0);
+    _hap_bsd_drained(sock);
+    return true;
+}
+
+void hap_network_send_pending(){
+    if(!_output_pool.empty()){
+        auto pending = vector<_hap_bsdsock*>();
+        pending.swap(_output_pool);
+        for(auto sock : pending){
+            sock->outQueued = false;
+            if(!_hap_bsd_write(sock)) hap_network_close(sock->conn);
+        }
+    }
+#ifdef USE_HAP_IO_URING
+    //The sends and re-armed requests of the iteration, in one go
+    if(_uring_enabled) io_uring_submit(&_uring);
+#endif
+}
+
+hap_network_connection * hap_network_find(uint32_t id){
+    auto index = id & 0xffff;
+    if(index == 0 || index > _slot_chunks.size() * HAP_BSD_SLOT_CHUNK) return nullptr;
+    auto sock = &_hap_bsd_slot(index - 1)->sock;
+    return (sock->id == id && !sock->closed) ? sock->conn : nullptr;
+}
+
+void hap_network_release(hap_network_connection * client){
+    auto slot = reinterpret_cast<_hap_bsdslot *>(reinterpret_cast<uint8_t *>(client) - offsetof(_hap_bsdslot, conn));
+    auto sock = &slot->sock;
+    sock->released = true;
+    if(sock->swept) _hap_bsd_free(sock);
+}
+
 void hap_network_close(hap_network_connection * client){
     if(client->raw == nullptr) return;
     hap_event_network_close(client);
     auto client_fd = static_cast<_hap_bsdsock*>(client->raw);
+
+    //Best effort to deliver what was sent before closing
+    if(client_fd->outQueued){
+        _hap_bsd_write(client_fd);
+        _output_pool.erase(find(_output_pool.begin(), _output_pool.end(), client_fd));
+        client_fd->outQueued = false;
+    }
+#ifdef USE_HAP_IO_URING
+    if(_uring_enabled) io_uring_submit(&_uring);
+#endif
     shutdown(client_fd->fd, 2);
 
-    //delete from pool
-    auto it = find(_conn_pool.begin(), _conn_pool.end(), client_fd);
-    _conn_pool.erase(it);
+#ifdef USE_HAP_EPOLL
+    _hap_bsd_unwatch(client_fd);
+#elif defined(USE_HAP_IO_URING)
+    if(_uring_enabled) _hap_bsd_unwatch(client_fd);
+#endif
+    close(client_fd->fd);
 
     auto addr_buf = new char[64]();
     inet_ntop(client_fd->addr.sin_family, &(client_fd->addr.sin_addr), addr_buf, 64);
     HAP_DEBUG("Client %s:%u closed the connection", addr_buf, client_fd->addr.sin_port);
     delete[] addr_buf;
 
-    delete client_fd;
+    //Unless it is being served, the socket is still in the deferred pool
+    if(client_fd->readDeferred){
+        auto deferred = find(_deferred_pool.begin(), _deferred_pool.end(), client_fd);
+        if(deferred != _deferred_pool.end()) _deferred_pool.erase(deferred);
+    }
+
+    if(client_fd->type == _hap_bsdsock::CLIENT_FD){
+        _hap_bsd_idle_unlink(client_fd);
+        --_client_count;
+    }
+
+    //The connection lives in the socket's slot
+    client_fd->closed = true;
+    client_fd->conn = nullptr;
+    _closed_pool.push_back(client_fd);
     client->raw = nullptr;
-    delete client;
+    client->id = 0;
 }
 
-void _hap_bsd_client_accept(_hap_bsdsock * sock){
-    auto addr = sockaddr_in();
-    socklen_t sin_size = sizeof(addr);
+/**
+ * Set up an accepted connection
+ */
+void _hap_bsd_client_attach(_hap_bsdsock * sock, int client_fd, sockaddr_in addr){
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+    auto nosigpipe = 1;
+    setsockopt(client_fd, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+#if HAP_SOCK_KEEPALIVE_IDLE > 0
+    //Detect the clients that went away without closing the connection
+    auto opt_v = 1;
+    setsockopt(client_fd, SOL_SOCKET, SO_KEEPALIVE, &opt_v, sizeof(opt_v));
+#ifdef TCP_KEEPIDLE
+    opt_v = HAP_SOCK_KEEPALIVE_IDLE;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPIDLE, &opt_v, sizeof(opt_v));
+#elif defined(TCP_KEEPALIVE)
+    opt_v = HAP_SOCK_KEEPALIVE_IDLE;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPALIVE, &opt_v, sizeof(opt_v));
+#endif
+#ifdef TCP_KEEPINTVL
+    opt_v = HAP_SOCK_KEEPALIVE_INTERVAL;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPINTVL, &opt_v, sizeof(opt_v));
+#endif
+#ifdef TCP_KEEPCNT
+    opt_v = HAP_SOCK_KEEPALIVE_COUNT;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPCNT, &opt_v, sizeof(opt_v));
+#endif
+#endif
 
-    auto client_fd = accept(sock->fd, reinterpret_cast<sockaddr *>(&addr), &sin_size);
-    N_RET(client_fd, "accept", HAP_NOTHING);
-    fcntl(client_fd, F_SETFL, O_NONBLOCK);
+#if HAP_NETWORK_MAX_CONNECTIONS > 0
+    if(_client_count >= HAP_NETWORK_MAX_CONNECTIONS){
+        auto victim = _hap_bsd_evictable();
+        HAP_DEBUG("Connection limit reached, evicting a %s connection", victim->verified ? "verified" : "unverified");
+        hap_network_close(victim->conn);
+    }
+#endif
+
+    auto client_sock = _hap_bsd_alloc(client_fd, _hap_bsdsock::CLIENT_FD, nullptr, addr);
+    if(client_sock == nullptr){
+        HAP_DEBUG("Too many connections");
+        close(client_fd);
+        return;
+    }
 
-    auto * client_conn = new hap_network_connection;
-    auto client_sock = new _hap_bsdsock(
-            client_fd,
-            _hap_bsdsock::CLIENT_FD,
-            client_conn,
-            addr);
+    auto client_conn = _hap_bsd_slot_conn(client_sock);
+    *client_conn = {};
     client_conn->raw = client_sock;
-    _conn_pool.push_back(client_sock);
+    client_conn->id = client_sock->id;
+    client_sock->conn = client_conn;
+    _hap_bsd_watch(client_sock);
+    ++_client_count;
 
     hap_event_network_accept(sock->conn, client_conn);
+    if(!client_sock->closed) _hap_bsd_touch(client_sock);
 
     auto addr_buf = new char[64]();
     inet_ntop(addr.sin_family, &(addr.sin_addr), addr_buf, 64);
@@ -152,39 +861,383 @@ void _hap_bsd_client_accept(_hap_bsdsock * sock){
     delete[] addr_buf;
 }
 
-void _hap_bsd_client_ondata(_hap_bsdsock * sock){
-    auto buf = new uint8_t[1024];
-    auto bread = recv(sock->fd, buf, 1024, MSG_DONTWAIT);
-    N_RET(bread, "recv", HAP_NOTHING);
-    if(bread > 0) hap_event_network_receive(sock->conn, buf, static_cast<unsigned int>(bread));
-    delete[] buf;
+/**
+ * Accept one pending connection
+ *
+ * @return false once there are no more connections to accept
+ */
+bool _hap_bsd_client_accept(_hap_bsdsock * sock){
+    auto addr = sockaddr_in();
+    socklen_t sin_size = sizeof(addr);
+
+#ifdef USE_HAP_EPOLL
+    auto client_fd = accept4(sock->fd, reinterpret_cast<sockaddr *>(&addr), &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    auto client_fd = accept(sock->fd, reinterpret_cast<sockaddr *>(&addr), &sin_size);
+#endif
+    if(client_fd < 0){
+        if(errno == EINTR || errno == ECONNABORTED) return true;
+        if(errno != EAGAIN && errno != EWOULDBLOCK){ HAP_BSD_ERRLOG("accept"); }
+        return false;
+    }
+#ifndef USE_HAP_EPOLL
+    fcntl(client_fd, F_SETFL, O_NONBLOCK);
+#endif
+    _hap_bsd_client_attach(sock, client_fd, addr);
+    return true;
+}
+
+/**
+ * Read until the socket would block or its read budget is used up
+ *
+ * @return false if the connection has been closed
+ */
+bool _hap_bsd_client_ondata(_hap_bsdsock * sock){
+    //Received data is consumed before recv() returns, so one buffer serves all connections of the thread
+    HAP_BSD_LOCAL uint8_t buf[HAP_BSD_RECV_BUFFER];
+#if HAP_NETWORK_READ_BUDGET > 0
+    unsigned int budget = HAP_NETWORK_READ_BUDGET;
+#endif
+    while (!sock->closed){
+#if HAP_NETWORK_READ_BUDGET > 0
+        //Let the other ready connections go first, the rest is read on the next turn
+        if(budget == 0){
+            sock->readDeferred = true;
+            _deferred_pool.push_back(sock);
+            break;
+        }
+        auto bread = recv(sock->fd, buf, budget < sizeof(buf) ? budget : sizeof(buf), MSG_DONTWAIT);
+        if(bread > 0) budget -= static_cast<unsigned int>(bread);
+#else
+        auto bread = recv(sock->fd, buf, sizeof(buf), MSG_DONTWAIT);
+#endif
+        if(bread > 0){
+            hap_event_network_receive(sock->conn, buf, static_cast<unsigned int>(bread));
+            if(!sock->closed) _hap_bsd_touch(sock);
+            continue;
+        }
+
+        //Orderly shutdown by the client
+        if(bread == 0){ hap_network_close(sock->conn); break; }
+
+        if(errno == EINTR) continue;
+        if(errno != EAGAIN && errno != EWOULDBLOCK){
+            HAP_BSD_ERRLOG("recv");
+            hap_network_close(sock->conn);
+        }
+        break;
+    }
+    return !sock->closed;
+}
+
+/**
+ * Connections deferred by the previous turn of the loop are served after
+ * the ones that became ready in this turn, each with a fresh budget, so
+ * a client streaming requests takes turns with the others.
+ */
+static void _hap_bsd_take_deferred(){
+    _deferred_serving.swap(_deferred_pool);
+}
+
+static void _hap_bsd_serve_deferred(){
+    //Reset first, a served connection may close one further in the list
+    for(auto sock : _deferred_serving) sock->readDeferred = false;
+    for(auto sock : _deferred_serving){
+        if(!sock->closed) _hap_bsd_client_ondata(sock);
+    }
+    _deferred_serving.clear();
 }
 
 void _hap_bsd_client_close(_hap_bsdsock * sock){
     hap_network_close(sock->conn);
 }
 
-void hap_network_loop(){
-    pollfd pfds[_conn_pool.size()];
-    transform(_conn_pool.begin(), _conn_pool.end(), pfds, [](_hap_bsdsock * sock){ return sock->pfd; });
+void _hap_bsd_wakeup_drain(_hap_bsdsock * sock){
+    uint8_t buf[64];
+    while (read(sock->fd, buf, sizeof(buf)) > 0);
+}
 
-    //New connections ready to accept
-    if(poll(pfds, static_cast<nfds_t>(_conn_pool.size()), 0) > 0){
-        for(auto i = 0; i < _conn_pool.size(); ++i){
-            auto bsdsock = _conn_pool[i];
-            //New data available
-            if(pfds[i].revents & POLLIN){
-                if(bsdsock->type == _hap_bsdsock::LISTENING_FD){ _hap_bsd_client_accept(bsdsock); }
-                else if(bsdsock->type == _hap_bsdsock::CLIENT_FD){ _hap_bsd_client_ondata(bsdsock); }
-            }
+void hap_network_wakeup(hap_network_connection * server){
+    if(server == nullptr || server->raw == nullptr) return;
+    auto wakeFd = static_cast<_hap_bsdsock*>(server->raw)->wakeFd;
+    if(wakeFd < 0) return;
+    uint8_t signal = 1;
+    //A full pipe already guarantees a wakeup, so the result is ignored
+    auto ret = write(wakeFd, &signal, 1);
+    (void) ret;
+}
+
+static void _hap_bsd_process(_hap_bsdsock * bsdsock, short revents){
+    if(bsdsock->closed) return;
+
+    //New data available
+    if(revents & POLLIN){
+        if(bsdsock->type == _hap_bsdsock::LISTENING_FD){ while (_hap_bsd_client_accept(bsdsock)); }
+        else if(bsdsock->type == _hap_bsdsock::CLIENT_FD){
+            //Deferred sockets are read when their turn comes
+            if(!bsdsock->readDeferred && !_hap_bsd_client_ondata(bsdsock)) return;
+        }
+        else if(bsdsock->type == _hap_bsdsock::WAKEUP_FD){ _hap_bsd_wakeup_drain(bsdsock); }
+    }
 
-            if(pfds[i].revents & POLLHUP){
-                if(bsdsock->type == _hap_bsdsock::CLIENT_FD){ _hap_bsd_client_close(bsdsock); }
+    //Room for the output that didn't fit earlier
+    if((revents & POLLOUT) && bsdsock->outWaiting){
+        if(!_hap_bsd_write(bsdsock)){
+            hap_network_close(bsdsock->conn);
+            return;
+        }
+    }
+
+    if(revents & (POLLHUP | POLLERR)){
+        if(bsdsock->type == _hap_bsdsock::CLIENT_FD){ _hap_bsd_client_close(bsdsock); }
+    }
+}
+
+#ifdef USE_HAP_IO_URING
+
+static void _hap_bsd_uring_sent(_hap_bsdsock * sock, int res){
+    if(res > 0) sock->sendOff += static_cast<unsigned int>(res);
+
+    //Partially sent, the rest goes out before anything queued after it
+    if(res >= 0 && sock->sendOff < sock->sendLen && !sock->closed){
+        _hap_bsd_uring_send_remaining(sock);
+        return;
+    }
+    sock->sendLen = 0;
+    sock->sendOff = 0;
+    if(sock->closed) return;
+    if(res < 0){
+        HAP_DEBUG("send(%d): %s", -res, strerror(-res));
+        hap_network_close(sock->conn);
+        return;
+    }
+    _hap_bsd_uring_send(sock);
+    _hap_bsd_drained(sock);
+}
+
+static void _hap_bsd_uring_received(_hap_bsdsock * sock, io_uring_cqe * cqe){
+    if(cqe->flags & IORING_CQE_F_BUFFER){
+        auto bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        auto buf = _uring_buf_mem + bid * HAP_BSD_RECV_BUFFER;
+
+        //Consumed before the handler returns, so the buffer goes straight back to the ring
+        if(cqe->res > 0 && !sock->closed){
+            hap_event_network_receive(sock->conn, buf, static_cast<unsigned int>(cqe->res));
+            if(!sock->closed) _hap_bsd_touch(sock);
+        }
+        io_uring_buf_ring_add(_uring_bufs, buf, HAP_BSD_RECV_BUFFER, static_cast<unsigned short>(bid),
+                io_uring_buf_ring_mask(HAP_URING_BUFFERS), 0);
+        io_uring_buf_ring_advance(_uring_bufs, 1);
+    }
+    if(sock->closed) return;
+
+    //Orderly shutdown by the client
+    if(cqe->res == 0){
+        hap_network_close(sock->conn);
+        return;
+    }
+
+    //Running out of buffers only ends the multishot receive, it is re-armed
+    if(cqe->res < 0 && cqe->res != -ENOBUFS){
+        HAP_DEBUG("recv(%d): %s", -cqe->res, strerror(-cqe->res));
+        hap_network_close(sock->conn);
+    }
+}
+
+static void _hap_bsd_uring_complete(io_uring_cqe * cqe){
+    auto data = io_uring_cqe_get_data64(cqe);
+    auto sock = reinterpret_cast<_hap_bsdsock *>(static_cast<uintptr_t>(data & ~static_cast<uint64_t>(HAP_URING_OP_MASK)));
+    if(sock == nullptr) return;
+
+    auto op = static_cast<_hap_uring_op>(data & HAP_URING_OP_MASK);
+    auto more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if(!more) --sock->uringOps;
+
+    switch (op) {
+        case URING_ACCEPT:
+            if(cqe->res >= 0 && !sock->closed){
+                //The multishot accept has no room for addresses, ask for it
+                auto addr = sockaddr_in();
+                socklen_t sin_size = sizeof(addr);
+                getpeername(cqe->res, reinterpret_cast<sockaddr *>(&addr), &sin_size);
+                _hap_bsd_client_attach(sock, cqe->res, addr);
+            } else if(cqe->res >= 0){
+                close(cqe->res);
+            } else if(cqe->res != -ECANCELED){
+                HAP_DEBUG("accept(%d): %s", -cqe->res, strerror(-cqe->res));
             }
+            break;
+        case URING_RECV:
+            _hap_bsd_uring_received(sock, cqe);
+            break;
+        case URING_SEND:
+            _hap_bsd_uring_sent(sock, cqe->res);
+            return;
+        case URING_POLL:
+            _hap_bsd_wakeup_drain(sock);
+            break;
+    }
+
+    //The kernel ends a multishot request when it can't go on, e.g. out of buffers
+    if(!more && !sock->closed) _hap_bsd_uring_arm(sock);
+}
+
+static void _hap_bsd_uring_dispatch(int timeout){
+    int ret;
+    if(timeout < 0){
+        ret = io_uring_submit_and_wait(&_uring, 1);
+    } else if(timeout == 0){
+        ret = io_uring_submit(&_uring);
+    } else {
+        io_uring_cqe * cqe;
+        __kernel_timespec ts {};
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        ret = io_uring_submit_and_wait_timeout(&_uring, &cqe, 1, &ts, nullptr);
+    }
+    if(ret < 0 && ret != -ETIME && ret != -EINTR){ HAP_DEBUG("io_uring_submit(%d): %s", -ret, strerror(-ret)); }
+
+    //Completions of requests submitted by the handlers are picked up as well
+    io_uring_cqe * cqe;
+    unsigned int head, count = 0;
+    io_uring_for_each_cqe(&_uring, head, cqe){
+        _hap_bsd_uring_complete(cqe);
+        ++count;
+    }
+    io_uring_cq_advance(&_uring, count);
+    _hap_bsd_sweep();
+}
+
+#endif
+
+#ifdef USE_HAP_EPOLL
+
+#ifndef HAP_EPOLL_MAX_EVENTS
+#define HAP_EPOLL_MAX_EVENTS 64
+#endif
+
+static void _hap_bsd_epoll_dispatch(int timeout){
+    _hap_bsd_take_deferred();
+    if(!_deferred_serving.empty()) timeout = 0;
+
+    epoll_event events[HAP_EPOLL_MAX_EVENTS];
+    auto ready = epoll_wait(_epoll_fd, events, HAP_EPOLL_MAX_EVENTS, timeout);
+    if(ready < 0){
+        if(errno != EINTR){ HAP_BSD_ERRLOG("epoll_wait"); }
+        ready = 0;
+    }
+
+    for(auto i = 0; i < ready; ++i){
+        auto flags = events[i].events;
+        auto revents = static_cast<short>(flags & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP));
+
+        //Half-closed by the client: reading will reach the end of stream
+        if(flags & EPOLLRDHUP) revents |= POLLIN;
+        _hap_bsd_process(static_cast<_hap_bsdsock *>(events[i].data.ptr), revents);
+    }
+    _hap_bsd_serve_deferred();
+    _hap_bsd_sweep();
+}
 
-            pfds[i].revents = 0;
+static void _hap_bsd_poller_loop(int timeout){
+    _hap_bsd_sweep();
+    _hap_bsd_epoll_dispatch(timeout);
+}
+
+static unsigned int _hap_bsd_poller_pollfds(hap_network_pollfd * fds, unsigned int max){
+    //The epoll instance becomes readable when any of its sockets is ready
+    if(max > 0) fds[0] = { _epoll_fd, POLLIN };
+    return 1;
+}
+
+static void _hap_bsd_poller_process(int fd, short revents){
+    //Deferred reads are served whatever woke the host up, the epoll instance
+    //doesn't become readable again for data that is already buffered
+    if((fd == _epoll_fd && (revents & POLLIN)) || !_deferred_pool.empty()){
+        _hap_bsd_sweep();
+        _hap_bsd_epoll_dispatch(0);
+    }
+}
+
+#else
+
+static void _hap_bsd_poller_loop(int timeout){
+    _hap_bsd_sweep();
+    _hap_bsd_take_deferred();
+    if(!_deferred_serving.empty()) timeout = 0;
+
+    //Sockets accepted while processing are appended and not polled yet
+    auto nfds = _pfds.size();
+    if(poll(_pfds.data(), static_cast<nfds_t>(nfds), timeout) > 0){
+        for(unsigned int i = 0; i < nfds; ++i){
+            auto revents = _pfds[i].revents;
+            if(revents) _hap_bsd_process(_pfd_socks[i], revents);
         }
     }
+    _hap_bsd_serve_deferred();
+    _hap_bsd_sweep();
+}
+
+static unsigned int _hap_bsd_poller_pollfds(hap_network_pollfd * fds, unsigned int max){
+    unsigned int count = 0;
+    for(auto& pfd : _pfds){
+        if(count < max) fds[count] = { pfd.fd, pfd.events };
+        ++count;
+    }
+    return count;
+}
+
+static void _hap_bsd_poller_process(int fd, short revents){
+    _hap_bsd_take_deferred();
+    for(unsigned int i = 0; i < _pfds.size(); ++i){
+        if(_pfds[i].fd == fd && !_pfd_socks[i]->closed){
+            _hap_bsd_process(_pfd_socks[i], revents);
+            break;
+        }
+    }
+    _hap_bsd_serve_deferred();
+    _hap_bsd_sweep();
+}
+
+#endif
+
+void hap_network_loop(int timeout){
+    timeout = _hap_bsd_reap(timeout);
+#ifdef USE_HAP_IO_URING
+    if(_uring_enabled){
+        _hap_bsd_sweep();
+        _hap_bsd_uring_dispatch(timeout);
+        return;
+    }
+#endif
+    _hap_bsd_poller_loop(timeout);
+}
+
+unsigned int hap_network_pollfds(hap_network_pollfd * fds, unsigned int max){
+#ifdef USE_HAP_IO_URING
+    //The ring becomes readable when completions are posted
+    if(_uring_enabled){
+        if(max > 0) fds[0] = { _uring.ring_fd, POLLIN };
+        return 1;
+    }
+#endif
+    return _hap_bsd_poller_pollfds(fds, max);
+}
+
+int hap_network_timeout(int timeout){
+    if(!_deferred_pool.empty()) return 0;
+    return _hap_bsd_reap(timeout);
+}
+
+void hap_network_process(int fd, short revents){
+    _hap_bsd_reap(-1);
+#ifdef USE_HAP_IO_URING
+    if(_uring_enabled){
+        if(fd == _uring.ring_fd && (revents & POLLIN)) _hap_bsd_uring_dispatch(0);
+        return;
+    }
+#endif
+    _hap_bsd_poller_process(fd, revents);
 }
 
 #endif
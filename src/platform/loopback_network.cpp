@@ -0,0 +1,428 @@
+/**
+ * hapd
+ *
+ * Copyright 2018 Xule Zhou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "../common.h"
+
+#ifdef USE_HAP_LOOPBACK
+
+#include "../network.h"
+#include "loopback_network.h"
+
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+//Every thread running a HAPServer has its own connections, see HAPServer::addShard()
+#ifdef USE_HAP_SHARDS
+#define HAP_LOOPBACK_LOCAL static thread_local
+#else
+#define HAP_LOOPBACK_LOCAL static
+#endif
+
+struct hap_loopback_client;
+
+/**
+ * State of a thread running hap_network_loop(), shared with the clients
+ * of its servers. The lock also guards the clients' buffers and flags.
+ */
+struct _hap_loopback_loop {
+    mutex lock;
+    condition_variable cond;
+    bool woken;
+
+    //Clients with something for their server
+    vector<hap_loopback_client*> ready;
+};
+
+struct _hap_loopback_server {
+    hap_network_connection * conn;
+    uint16_t port;
+    _hap_loopback_loop * loop;
+};
+
+struct hap_loopback_client {
+    //The server side of the connection
+    hap_network_connection conn;
+    _hap_loopback_server * server;
+    _hap_loopback_loop * loop;
+
+    //Written by the client and not delivered yet, with the length of each write
+    vector<uint8_t> input;
+    vector<unsigned int> writes;
+
+    //Sent by the server, read by the client from outputOff
+    vector<uint8_t> output;
+    size_t outputOff;
+
+    bool accepted;
+    bool readyQueued;
+    bool disconnecting;
+    bool closed;
+    bool congested;
+
+    //The client and the server each hold a reference
+    int refs;
+};
+
+//Servers bound in any thread, looked up by hap_loopback_connect()
+static mutex _registry_lock;
+static auto _servers = vector<_hap_loopback_server*>();
+static unsigned int _connects = 0;
+static uint32_t _next_id = 0;
+
+HAP_LOOPBACK_LOCAL _hap_loopback_loop * _local_loop = nullptr;
+
+//Connections accepted by the servers of this thread
+HAP_LOOPBACK_LOCAL auto _open = vector<hap_loopback_client*>();
+
+//Closed by the server, until HAPServer is done with them, see hap_network_release()
+HAP_LOOPBACK_LOCAL auto _closed_pool = vector<hap_loopback_client*>();
+
+//Reused between iterations
+HAP_LOOPBACK_LOCAL auto _processing = vector<hap_loopback_client*>();
+HAP_LOOPBACK_LOCAL auto _received = vector<uint8_t>();
+HAP_LOOPBACK_LOCAL auto _received_writes = vector<unsigned int>();
+
+/**
+ * Have the loop of the client's server look at it, with the loop locked
+ */
+static void _hap_loopback_queue(hap_loopback_client * client){
+    if(client->readyQueued) return;
+    client->readyQueued = true;
+    client->loop->ready.push_back(client);
+    client->loop->cond.notify_one();
+}
+
+static size_t _hap_loopback_queued(hap_loopback_client * client){
+    return client->output.size() - client->outputOff;
+}
+
+/**
+ * Drop a reference to the client, freeing it with the last one
+ */
+static void _hap_loopback_release(hap_loopback_client * client){
+    bool last;
+    {
+        lock_guard<mutex> guard(client->loop->lock);
+        last = --client->refs == 0;
+    }
+    if(last) delete client;
+}
+
+
+/**
+ * Deliver what the client has for the server
+ */
+static void _hap_loopback_process(hap_loopback_client * client){
+    unique_lock<mutex> guard(client->loop->lock);
+    client->readyQueued = false;
+    if(client->closed) return;
+
+    if(!client->accepted){
+        client->accepted = true;
+        guard.unlock();
+        _open.push_back(client);
+        hap_event_network_accept(client->server->conn, &client->conn);
+        guard.lock();
+    }
+
+    //Writes that fit in the read budget, at least one, the rest waits for the next turn
+    size_t taken = 0;
+    size_t count = 0;
+    for(auto length : client->writes){
+        if(HAP_NETWORK_READ_BUDGET > 0 && count > 0 && taken + length > HAP_NETWORK_READ_BUDGET) break;
+        taken += length;
+        ++count;
+    }
+    if(count == client->writes.size()){
+        _received.swap(client->input);
+        _received_writes.swap(client->writes);
+    } else {
+        _received.assign(client->input.begin(), client->input.begin() + taken);
+        _received_writes.assign(client->writes.begin(), client->writes.begin() + count);
+        client->input.erase(client->input.begin(), client->input.begin() + taken);
+        client->writes.erase(client->writes.begin(), client->writes.begin() + count);
+        _hap_loopback_queue(client);
+    }
+    auto disconnecting = client->disconnecting && client->writes.empty();
+    auto drained = client->congested && _hap_loopback_queued(client) <= HAP_NETWORK_OUTPUT_LOW_WATERMARK;
+    if(drained) client->congested = false;
+    guard.unlock();
+
+    //One receive per write, unless the server closes the connection meanwhile
+    size_t offset = 0;
+    for(auto length : _received_writes){
+        if(client->conn.raw == nullptr) break;
+        hap_event_network_receive(&client->conn, _received.data() + offset, length);
+        offset += length;
+    }
+    _received.clear();
+    _received_writes.clear();
+
+    if(drained && client->conn.raw) hap_event_network_congestion(&client->conn, false);
+    if(disconnecting) hap_network_close(&client->conn);
+}
+
+/**
+ * Implementations for hap_network
+ */
+
+bool hap_network_init_bind(hap_network_connection * conn, uint16_t port){
+    if(_local_loop == nullptr){
+        _local_loop = new _hap_loopback_loop();
+        _local_loop->woken = false;
+    }
+
+    auto server = new _hap_loopback_server { conn, port, _local_loop };
+    conn->raw = server;
+    conn->id = 0;
+
+    lock_guard<mutex> guard(_registry_lock);
+    _servers.push_back(server);
+    HAP_DEBUG("Loopback server bound to port: %u", port);
+    return true;
+}
+
+bool hap_network_send(hap_network_connection * client, const uint8_t * data, unsigned int length){
+    hap_network_iovec iov { data, length };
+    return hap_network_sendv(client, &iov, 1);
+}
+
+bool hap_network_sendv(hap_network_connection * client, const hap_network_iovec * iov, unsigned int count){
+    if(client->raw == nullptr) return false;
+    auto lclient = static_cast<hap_loopback_client*>(client->raw);
+
+    unsigned int length = 0;
+    for(unsigned int i = 0; i < count; ++i) length += iov[i].length;
+
+    unique_lock<mutex> guard(lclient->loop->lock);
+
+    //The client stopped reading, don't let its output grow without bound
+    if(_hap_loopback_queued(lclient) + length > HAP_NETWORK_OUTPUT_LIMIT){
+        HAP_DEBUG("Output limit reached with %u bytes queued", static_cast<unsigned int>(_hap_loopback_queued(lclient)));
+        guard.unlock();
+        hap_network_close(client);
+        return false;
+    }
+
+    for(unsigned int i = 0; i < count; ++i){
+        lclient->output.insert(lclient->output.end(), iov[i].data, iov[i].data + iov[i].length);
+    }
+
+    auto congested = !lclient->congested && _hap_loopback_queued(lclient) >= HAP_NETWORK_OUTPUT_HIGH_WATERMARK;
+    if(congested) lclient->congested = true;
+    guard.unlock();
+
+    if(congested) hap_event_network_congestion(client, true);
+    return true;
+}
+
+//The client can read what is sent right away
+void hap_network_send_pending(){ }
+
+void hap_network_close(hap_network_connection * client){
+    if(client->raw == nullptr) return;
+    hap_event_network_close(client);
+    auto lclient = static_cast<hap_loopback_client*>(client->raw);
+    {
+        lock_guard<mutex> guard(lclient->loop->lock);
+        lclient->closed = true;
+        if(lclient->readyQueued){
+            auto& ready = lclient->loop->ready;
+            ready.erase(find(ready.begin(), ready.end(), lclient));
+            lclient->readyQueued = false;
+        }
+    }
+
+    _open.erase(find(_open.begin(), _open.end(), lclient));
+    _closed_pool.push_back(lclient);
+    client->raw = nullptr;
+    client->id = 0;
+}
+
+void hap_network_release(hap_network_connection * client){
+    for(auto it = _closed_pool.begin(); it != _closed_pool.end(); ++it){
+        if(&(*it)->conn != client) continue;
+        auto lclient = *it;
+        _closed_pool.erase(it);
+        _hap_loopback_release(lclient);
+        return;
+    }
+}
+
+void hap_network_loop(int timeout){
+    auto loop = _local_loop;
+    if(loop == nullptr) return;
+
+    {
+        unique_lock<mutex> guard(loop->lock);
+        auto busy = [loop]{ return loop->woken || !loop->ready.empty(); };
+        if(timeout < 0) loop->cond.wait(guard, busy);
+        else if(timeout > 0) loop->cond.wait_for(guard, chrono::milliseconds(timeout), busy);
+        loop->woken = false;
+        _processing.swap(loop->ready);
+    }
+
+    for(auto client : _processing) _hap_loopback_process(client);
+    _processing.clear();
+}
+
+void hap_network_wakeup(hap_network_connection * server){
+    if(server == nullptr || server->raw == nullptr) return;
+    auto loop = static_cast<_hap_loopback_server*>(server->raw)->loop;
+    lock_guard<mutex> guard(loop->lock);
+    loop->woken = true;
+    loop->cond.notify_one();
+}
+
+//Only driven by hap_network_loop(), there is no descriptor to poll
+unsigned int hap_network_pollfds(hap_network_pollfd *, unsigned int){ return 0; }
+
+int hap_network_timeout(int timeout){ return timeout; }
+
+void hap_network_process(int, short){ }
+
+hap_network_connection * hap_network_find(uint32_t id){
+    for(auto client : _open){
+        if(client->conn.id == id) return &client->conn;
+    }
+    return nullptr;
+}
+
+/**
+ * Implementations for the clients
+ */
+
+hap_loopback_client * hap_loopback_connect(uint16_t port){
+    _hap_loopback_server * server = nullptr;
+    uint32_t id;
+    {
+        lock_guard<mutex> guard(_registry_lock);
+        auto bound = static_cast<unsigned int>(count_if(_servers.begin(), _servers.end(), [port](_hap_loopback_server * s){
+            return s->port == port;
+        }));
+        if(bound == 0) return nullptr;
+
+        auto turn = _connects++ % bound;
+        for(auto s : _servers){
+            if(s->port == port && turn-- == 0){
+                server = s;
+                break;
+            }
+        }
+
+        if(++_next_id == 0) ++_next_id;
+        id = _next_id;
+    }
+
+    auto client = new hap_loopback_client();
+    client->conn.raw = client;
+    client->conn.server = nullptr;
+    client->conn.user = nullptr;
+    client->conn.id = id;
+    client->server = server;
+    client->loop = server->loop;
+    client->outputOff = 0;
+    client->accepted = false;
+    client->readyQueued = false;
+    client->disconnecting = false;
+    client->closed = false;
+    client->congested = false;
+    client->refs = 2;
+
+    lock_guard<mutex> guard(client->loop->lock);
+    _hap_loopback_queue(client);
+    return client;
+}
+
+bool hap_loopback_write(hap_loopback_client * client, const uint8_t * data, unsigned int length){
+    lock_guard<mutex> guard(client->loop->lock);
+    if(client->closed || client->disconnecting) return false;
+    if(length == 0) return true;
+
+    client->input.insert(client->input.end(), data, data + length);
+    client->writes.push_back(length);
+    _hap_loopback_queue(client);
+    return true;
+}
+
+unsigned int hap_loopback_read(hap_loopback_client * client, uint8_t * buf, unsigned int max){
+    lock_guard<mutex> guard(client->loop->lock);
+    auto length = static_cast<unsigned int>(min(static_cast<size_t>(max), _hap_loopback_queued(client)));
+    memcpy(buf, client->output.data() + client->outputOff, length);
+    client->outputOff += length;
+
+    //Move the unread data to the front once the read part dominates
+    if(client->outputOff == client->output.size()){
+        client->output.clear();
+        client->outputOff = 0;
+    } else if(client->outputOff * 2 >= client->output.size()){
+        client->output.erase(client->output.begin(), client->output.begin() + client->outputOff);
+        client->outputOff = 0;
+    }
+
+    //The server is told at its next loop
+    if(client->congested && !client->closed && _hap_loopback_queued(client) <= HAP_NETWORK_OUTPUT_LOW_WATERMARK){
+        _hap_loopback_queue(client);
+    }
+    return length;
+}
+
+unsigned int hap_loopback_available(hap_loopback_client * client){
+    lock_guard<mutex> guard(client->loop->lock);
+    return static_cast<unsigned int>(_hap_loopback_queued(client));
+}
+
+bool hap_loopback_connected(hap_loopback_client * client){
+    lock_guard<mutex> guard(client->loop->lock);
+    return !client->closed;
+}
+
+void hap_loopback_disconnect(hap_loopback_client * client){
+    {
+        lock_guard<mutex> guard(client->loop->lock);
+        client->disconnecting = true;
+        if(!client->closed) _hap_loopback_queue(client);
+    }
+    _hap_loopback_release(client);
+}
+
+//Nothing to advertise for clients in the same process
+#ifndef USE_APPLE_DNS_SD
+void * hap_service_discovery_init(const char *, uint16_t){ return nullptr; }
+
+bool hap_service_discovery_update(void *, hap_sd_txt_item *){ return false; }
+
+void hap_service_discovery_loop(void *){ }
+
+void hap_service_discovery_deinit(void *){ }
+#endif
+
+#endif
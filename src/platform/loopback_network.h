@@ -0,0 +1,91 @@
+/**
+ * hapd
+ *
+ * Copyright 2018 Xule Zhou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HAPD_LOOPBACK_NETWORK_H
+#define HAPD_LOOPBACK_NETWORK_H
+
+#include "../common.h"
+
+#ifdef USE_HAP_LOOPBACK
+
+/**
+ * Built with -DUSE_HAP_LOOPBACK, the network implementation has no sockets:
+ * clients are opened in memory with the functions below, so the protocol
+ * layers can be exercised and measured without the kernel in the way.
+ *
+ * Everything a client writes is handed to the server by the next turns of
+ * hap_network_loop() on the server's thread, one hap_event_network_receive()
+ * per write and up to HAP_NETWORK_READ_BUDGET bytes per turn. What the
+ * server sends can be read right away. The client functions can be called
+ * from any thread.
+ */
+struct hap_loopback_client;
+
+/**
+ * Open a connection to the server bound to a port, accepted by its next
+ * hap_network_loop(). Servers of a shard group bound to the same port
+ * take the connections in turn.
+ *
+ * @param port The port given to hap_network_init_bind()
+ * @return nullptr if no server is bound to the port
+ */
+hap_loopback_client * hap_loopback_connect(uint16_t port);
+
+/**
+ * Send data to the server
+ *
+ * @return false if the connection is closed
+ */
+bool hap_loopback_write(hap_loopback_client * client, const uint8_t * data, unsigned int length);
+
+/**
+ * Take data sent by the server
+ *
+ * @param buf Buffer to fill
+ * @param max Capacity of buf
+ * @return Number of bytes copied
+ */
+unsigned int hap_loopback_read(hap_loopback_client * client, uint8_t * buf, unsigned int max);
+
+/**
+ * Number of bytes sent by the server and not read yet
+ */
+unsigned int hap_loopback_available(hap_loopback_client * client);
+
+/**
+ * Whether the server still has the connection open
+ */
+bool hap_loopback_connected(hap_loopback_client * client);
+
+/**
+ * Close the connection, if the server hasn't, and free the client
+ *
+ * The server sees the connection closed by its next hap_network_loop().
+ */
+void hap_loopback_disconnect(hap_loopback_client * client);
+
+#endif
+
+#endif //HAPD_LOOPBACK_NETWORK_H
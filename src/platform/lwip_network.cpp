@@ -29,6 +29,8 @@
 
 #include "../network.h"
 
+#include <cstring>
+
 extern "C" {
 #include <lwip/tcp.h>
 };
@@ -39,6 +41,43 @@ extern "C" {
 
 #define HAPCONN_PCB(conn) (reinterpret_cast<tcp_pcb *>((conn)->raw))
 
+#ifndef HAPLWIP_RECV_SEGMENTS
+//Segments of a received pbuf chain handed over without allocating
+#define HAPLWIP_RECV_SEGMENTS 8
+#endif
+
+/**
+ * An accepted connection, with the output lwip had no room for
+ */
+struct _hap_lwip_client {
+    hap_network_connection conn;
+
+    //Written as the client acknowledges what is in flight, see hap_lwip_sent()
+    uint8_t * outBuf;
+    unsigned int outLen;
+    unsigned int outCap;
+
+    //Over the high watermark, until drained below the low watermark
+    bool outCongested;
+
+    //Written to lwip and waiting for tcp_output() in hap_network_send_pending()
+    bool outPending;
+    _hap_lwip_client * nextPending;
+
+    //Open connections, looked up by hap_network_find()
+    _hap_lwip_client * nextOpen;
+
+    //Handlers of hap_lwip_receive() may close the connection and even release
+    //it, then the pcb must not be used and the memory is freed on return
+    bool receiving;
+    bool released;
+    bool aborted;
+};
+
+static _hap_lwip_client * _pending_output = nullptr;
+static _hap_lwip_client * _open_clients = nullptr;
+static uint32_t _next_id = 0;
+
 /**
  * Events handlers for lwip
  */
@@ -74,58 +113,176 @@ err_t _hap_lwip_close(struct tcp_pcb * pcb){
     return ERR_OK;
 }
 
+/**
+ * Forget a connection whose pcb is closed or gone. The connection itself
+ * stays until hap_network_release().
+ */
+static void _hap_lwip_closed(_hap_lwip_client * client){
+    if(client->outPending){
+        auto link = &_pending_output;
+        while (*link != client) link = &(*link)->nextPending;
+        *link = client->nextPending;
+        client->outPending = false;
+    }
+    auto link = &_open_clients;
+    while (*link != client) link = &(*link)->nextOpen;
+    *link = client->nextOpen;
+
+    delete[] client->outBuf;
+    client->outBuf = nullptr;
+    client->outLen = 0;
+    client->outCap = 0;
+    client->conn.raw = nullptr;
+    client->conn.id = 0;
+}
+
+/**
+ * Have hap_network_send_pending() push out what was written to lwip
+ */
+static void _hap_lwip_pending(_hap_lwip_client * client){
+    if(client->outPending) return;
+    client->outPending = true;
+    client->nextPending = _pending_output;
+    _pending_output = client;
+}
+
+/**
+ * Hand as much data to lwip as its send buffer takes
+ *
+ * @param more More data follows, so the last segment isn't pushed yet
+ * @return Bytes taken, -1 if the connection failed
+ */
+static int _hap_lwip_write(tcp_pcb * pcb, const uint8_t * data, unsigned int length, bool more){
+    unsigned int taken = 0;
+    while (taken < length){
+        auto room = static_cast<unsigned int>(tcp_sndbuf(pcb));
+        if(room == 0 || tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN) break;
+
+        auto chunk = length - taken;
+        if(chunk > room) chunk = room;
+        u8_t flags = TCP_WRITE_FLAG_COPY;
+        if(more || taken + chunk < length) flags |= TCP_WRITE_FLAG_MORE;
+
+        auto err = tcp_write(pcb, data + taken, static_cast<u16_t>(chunk), flags);
+        if(err == ERR_MEM) break;
+        if(err != ERR_OK){
+            HAP_DEBUG("Unable to write data to buffer: %ld", err);
+            return -1;
+        }
+        taken += chunk;
+    }
+    return static_cast<int>(taken);
+}
+
+/**
+ * Write the output that didn't fit earlier, as far as lwip takes it
+ *
+ * @return false if the connection failed
+ */
+static bool _hap_lwip_flush(_hap_lwip_client * client){
+    if(client->outLen){
+        auto taken = _hap_lwip_write(HAPCONN_PCB(&client->conn), client->outBuf, client->outLen, false);
+        if(taken < 0) return false;
+
+        client->outLen -= taken;
+        if(client->outLen) memmove(client->outBuf, client->outBuf + taken, client->outLen);
+        if(taken > 0) _hap_lwip_pending(client);
+    }
+
+    if(client->outCongested && client->outLen <= HAP_NETWORK_OUTPUT_LOW_WATERMARK){
+        client->outCongested = false;
+        hap_event_network_congestion(&client->conn, false);
+    }
+    return true;
+}
+
 /**
  * Called when lwip receives data from clients
  *
- * @param client Client socket pcb wrapped in hap_network_connection*
+ * @param client Client socket pcb wrapped in _hap_lwip_client*
  * @param tpcb Client pcb
  * @param p
  * @param err
  * @return OK normally
  */
 err_t hap_lwip_receive(void * client, struct tcp_pcb * tpcb, struct pbuf * buffer, err_t err){
-    auto hapconn = reinterpret_cast<hap_network_connection *>(client);
-    if(buffer){
-        struct pbuf * current;
-        while (buffer != nullptr){
-            current = buffer;
-
-//            HAP_DEBUG("Read %u bytes from %08x:%u", current->len, tpcb->remote_ip, tpcb->remote_port);
-            tcp_recved(HAPCONN_PCB(hapconn), buffer->len);
-            hap_event_network_receive(hapconn, static_cast<const uint8_t *>(current->payload), current->len);
-
-            buffer = current->next;
-            current->next = nullptr;
-            pbuf_free(current);
-        }
-    } else { //Connection closed
-        hap_event_network_close(hapconn);
-        delete hapconn;
+    auto lclient = static_cast<_hap_lwip_client *>(client);
+    if(buffer == nullptr){ //Connection closed
+        hap_event_network_close(&lclient->conn);
+        _hap_lwip_closed(lclient);
         return _hap_lwip_close(tpcb);
     }
-    return ERR_OK;
+
+    //Reopen the window before the handlers get a chance to close the pcb
+    tcp_recved(tpcb, buffer->tot_len);
+
+    //The segments of the chain are handed over in place
+    unsigned int count = 0;
+    for(auto p = buffer; p != nullptr; p = p->next) ++count;
+
+    hap_network_iovec segments[HAPLWIP_RECV_SEGMENTS];
+    auto iov = count <= HAPLWIP_RECV_SEGMENTS ? segments : new hap_network_iovec[count];
+    unsigned int i = 0;
+    for(auto p = buffer; p != nullptr; p = p->next){
+        iov[i++] = { static_cast<const uint8_t *>(p->payload), p->len };
+    }
+    lclient->receiving = true;
+    hap_event_network_receivev(&lclient->conn, iov, count);
+    lclient->receiving = false;
+    if(iov != segments) delete[] iov;
+
+    pbuf_free(buffer);
+
+    //lwip must be told when the pcb was aborted from within its callback
+    auto result = (lclient->conn.raw == nullptr && lclient->aborted) ? ERR_ABRT : ERR_OK;
+    if(lclient->released) delete lclient;
+    return result;
+}
+
+/**
+ * Called when the client acknowledged sent data, making room for more
+ *
+ * @param client Client socket pcb wrapped in _hap_lwip_client*
+ * @param tpcb Client pcb
+ * @param len Bytes acknowledged
+ * @return OK normally
+ */
+err_t hap_lwip_sent(void * client, struct tcp_pcb * tpcb, u16_t len){
+    auto lclient = static_cast<_hap_lwip_client *>(client);
+    if(_hap_lwip_flush(lclient)) return ERR_OK;
+
+    hap_event_network_close(&lclient->conn);
+    _hap_lwip_closed(lclient);
+    return _hap_lwip_close(tpcb);
 }
 
 /**
  * Called by lwip when application polling
  *
- * @param client Client socket pcb wrapped in hap_network_connection*
+ * Retries the queued output in case lwip was short of segments rather
+ * than window when the last acknowledgement came.
+ *
+ * @param client Client socket pcb wrapped in _hap_lwip_client*
  * @param tpcb Client pcb
  * @return OK normally
  */
 err_t hap_lwip_poll(void * client, struct tcp_pcb *tpcb){
-    //TODO
-    return ERR_OK;
+    return hap_lwip_sent(client, tpcb, 0);
 }
 
 /**
- * Called when an error occured
+ * Called when an error occured, the pcb is already freed by lwip
  *
- * @param client Client socket pcb wrapped in hap_network_connection*
+ * @param client Client socket pcb wrapped in _hap_lwip_client*
  * @param err Error code
  */
 void hap_lwip_error(void * client, err_t err){
     HAP_DEBUG("lwip error: %ld", err);
+    auto lclient = static_cast<_hap_lwip_client *>(client);
+    if(lclient == nullptr) return;
+
+    hap_event_network_close(&lclient->conn);
+    _hap_lwip_closed(lclient);
 }
 
 /**
@@ -137,8 +294,23 @@ void hap_lwip_error(void * client, err_t err){
  * @return OK normally
  */
 err_t hap_lwip_accept(void * conn, tcp_pcb * pcb, err_t err){
-    auto * client_conn = new hap_network_connection;
+    auto client = new _hap_lwip_client();
+    auto client_conn = &client->conn;
     client_conn->raw = pcb;
+    //0 is never a valid id
+    if(++_next_id == 0) ++_next_id;
+    client_conn->id = _next_id;
+    client->outBuf = nullptr;
+    client->outLen = 0;
+    client->outCap = 0;
+    client->outCongested = false;
+    client->outPending = false;
+    client->nextPending = nullptr;
+    client->nextOpen = _open_clients;
+    _open_clients = client;
+    client->receiving = false;
+    client->released = false;
+    client->aborted = false;
 
     tcp_accepted(HAPCONN_PCB(client_conn));
 #if HAP_SOCK_TCP_NODELAY
@@ -146,8 +318,18 @@ err_t hap_lwip_accept(void * conn, tcp_pcb * pcb, err_t err){
 #else
     tcp_nagle_enable(HAPCONN_PCB(client_conn));
 #endif
-    tcp_arg(HAPCONN_PCB(client_conn), client_conn);
+#if HAP_SOCK_KEEPALIVE_IDLE > 0
+    //Free the pcb of clients that went away without closing the connection
+    pcb->so_options |= SOF_KEEPALIVE;
+#if LWIP_TCP_KEEPALIVE
+    pcb->keep_idle = HAP_SOCK_KEEPALIVE_IDLE * 1000UL;
+    pcb->keep_intvl = HAP_SOCK_KEEPALIVE_INTERVAL * 1000UL;
+    pcb->keep_cnt = HAP_SOCK_KEEPALIVE_COUNT;
+#endif
+#endif
+    tcp_arg(HAPCONN_PCB(client_conn), client);
     tcp_recv(HAPCONN_PCB(client_conn), &hap_lwip_receive);
+    tcp_sent(HAPCONN_PCB(client_conn), &hap_lwip_sent);
     tcp_err(HAPCONN_PCB(client_conn), &hap_lwip_error);
     tcp_poll(HAPCONN_PCB(client_conn), &hap_lwip_poll, 1);
 
@@ -206,35 +388,119 @@ bool hap_network_init_bind(hap_network_connection * conn, uint16_t port){
  * @return
  */
 bool hap_network_send(hap_network_connection * client, const uint8_t * data, unsigned int length){
-    auto err = tcp_write(HAPCONN_PCB(client), data, static_cast<u16_t>(length), 0);
-    if(err != ERR_OK){
-        HAP_DEBUG("Unable to write data to buffer: %ld", err);
-        return false;
-    }
+    hap_network_iovec iov { data, length };
+    return hap_network_sendv(client, &iov, 1);
+}
 
-    err = tcp_output(HAPCONN_PCB(client));
-    if(err != ERR_OK){
-        HAP_DEBUG("Unable to send packet: %ld", err);
+bool hap_network_sendv(hap_network_connection * client, const hap_network_iovec * iov, unsigned int count){
+    if(client->raw == nullptr) return false;
+    auto lclient = reinterpret_cast<_hap_lwip_client *>(client);
+
+    unsigned int length = 0;
+    for(unsigned int i = 0; i < count; ++i) length += iov[i].length;
+
+    //The client stopped reading, don't let its output grow without bound
+    if(lclient->outLen + length > HAP_NETWORK_OUTPUT_LIMIT){
+        HAP_DEBUG("Output limit reached with %u bytes queued", lclient->outLen);
+        hap_network_close(client);
         return false;
     }
 
-    //todo: remove
-    HAP_DEBUG("Bytes sent: %d", length);
+    //Segments are only pushed out after the last buffer
+    for(unsigned int i = 0; i < count; ++i){
+        auto data = iov[i].data;
+        auto left = iov[i].length;
+
+        //Nothing may overtake the output waiting for room
+        if(lclient->outLen == 0){
+            auto taken = _hap_lwip_write(HAPCONN_PCB(client), data, left, i + 1 < count);
+            if(taken < 0){
+                hap_network_close(client);
+                return false;
+            }
+            data += taken;
+            left -= taken;
+        }
+        if(left == 0) continue;
+
+        if(lclient->outLen + left > lclient->outCap){
+            auto capacity = lclient->outCap ? lclient->outCap : 512u;
+            while (capacity < lclient->outLen + left) capacity *= 2;
+            auto buf = new uint8_t[capacity];
+            if(lclient->outLen) memcpy(buf, lclient->outBuf, lclient->outLen);
+            delete[] lclient->outBuf;
+            lclient->outBuf = buf;
+            lclient->outCap = capacity;
+        }
+        memcpy(lclient->outBuf + lclient->outLen, data, left);
+        lclient->outLen += left;
+    }
+    _hap_lwip_pending(lclient);
 
+    if(!lclient->outCongested && lclient->outLen >= HAP_NETWORK_OUTPUT_HIGH_WATERMARK){
+        lclient->outCongested = true;
+        hap_event_network_congestion(client, true);
+    }
     return true;
 }
 
+void hap_network_send_pending(){
+    while (auto client = _pending_output){
+        _pending_output = client->nextPending;
+        client->outPending = false;
+        client->nextPending = nullptr;
+
+        auto err = tcp_output(HAPCONN_PCB(&client->conn));
+        if(err != ERR_OK){ HAP_DEBUG("Unable to send packet: %ld", err); }
+    }
+}
+
+hap_network_connection * hap_network_find(uint32_t id){
+    //Only a handful of connections fit in memory anyway
+    for(auto client = _open_clients; client != nullptr; client = client->nextOpen){
+        if(client->conn.id == id) return &client->conn;
+    }
+    return nullptr;
+}
+
 /**
  * Close tcp connection and call the callbacks
  * @param client
  */
 void hap_network_close(hap_network_connection * client){
+    if(client->raw == nullptr) return;
     hap_event_network_close(client);
-    _hap_lwip_close(HAPCONN_PCB(client));
-    delete client; //At last, we have to delete the memory allocated for the connection
+
+    //Best effort to deliver what was sent before closing
+    auto lclient = reinterpret_cast<_hap_lwip_client *>(client);
+    if(lclient->outLen) _hap_lwip_write(HAPCONN_PCB(client), lclient->outBuf, lclient->outLen, false);
+
+    lclient->aborted = _hap_lwip_close(HAPCONN_PCB(client)) == ERR_ABRT;
+    _hap_lwip_closed(lclient);
+}
+
+void hap_network_release(hap_network_connection * client){
+    auto lclient = reinterpret_cast<_hap_lwip_client *>(client);
+    //Still used by hap_lwip_receive() once the handlers return
+    if(lclient->receiving){
+        lclient->released = true;
+        return;
+    }
+    //At last, we have to delete the memory allocated for the connection
+    delete lclient;
 }
 
 //Since lwip_tcp is already event driven, leave empty in the loop
-void hap_network_loop(){ }
+void hap_network_loop(int){ }
+
+//Never blocks, nothing to wake up
+void hap_network_wakeup(hap_network_connection *){ }
+
+//Driven by lwip callbacks, there is no descriptor to poll
+unsigned int hap_network_pollfds(hap_network_pollfd *, unsigned int){ return 0; }
+
+int hap_network_timeout(int timeout){ return timeout; }
+
+void hap_network_process(int, short){ }
 
 #endif
@@ -23,6 +23,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <cstring>
 #include "HomeKitAccessory.h"
 #include "json/jsmn.h"
 
@@ -38,10 +38,7 @@ int main(){
     HKAccessory.begin();
     HKAccessory.getAccessory()->addService<Switch>();
 
-    while (1){
-        HKAccessory.handle();
-        usleep(2e4);
-    }
+    HKAccessory.run();
 }
 
 #endif